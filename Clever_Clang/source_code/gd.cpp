@@ -1,16 +1,277 @@
 #include "gd.h"
 
+#include <omp.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// A baseline x86_64 build has no FMA, so the scalar kernel never contracts
+// a*b+c; the AVX-512 variants would, so contraction is switched off there.
+// clang marks contractible expressions per source function, before inlining
+// into the target("avx512f") variants, so the pragma covers the whole file
+// (GdStart::at and descend included); gcc decides per caller, after inlining.
+#if defined(__x86_64__) && !defined(__FMA__)
+#define GD_NO_CONTRACT 1
+#else
+#define GD_NO_CONTRACT 0
+#endif
+#if GD_NO_CONTRACT && defined(__clang__)
+#pragma clang fp contract(off)
+#endif
+#if GD_NO_CONTRACT && !defined(__clang__)
+#define GD_EXACT_FP __attribute__((optimize("fp-contract=off")))
+#else
+#define GD_EXACT_FP
+#endif
+
 inline float poly_gradient(float x, const PolyParams* params) {
     return 4 * params->a * x * x * x + 3 * params->b * x * x + 2 * params->c * x + params->d;
 }
 
-void gradient_descent(float *points, uint32_t N, uint32_t M, float eta, const PolyParams* params) {
-    for (uint32_t i = 0; i < N; ++i) {
-        float x = points[i];
+inline float descend(float x, uint32_t M, float eta, const PolyParams* params) {
+    for (uint32_t j = 0; j < M; ++j) {
+        float grad = poly_gradient(x, params);
+        x -= eta * grad;
+    }
+    return x;
+}
+
+// Where a kernel reads its starting points: an existing array, or the grid
+// a + i * interval when src is null.
+struct GdStart {
+    const float *src;
+    float a, interval;
+    float at(uint32_t i) const { return src ? src[i] : a + i * interval; }
+};
+
+// Every kernel computes exactly the per-point operation sequence of
+// poly_gradient/descend, only on more points at once, so all variants
+// produce bit-identical results.
+typedef void (*GdKernelFn)(float *points, GdStart start, uint32_t begin, uint32_t end,
+                           uint32_t M, float eta, const PolyParams* params);
+
+static void kernel_scalar(float *points, GdStart start, uint32_t begin, uint32_t end,
+                          uint32_t M, float eta, const PolyParams* params) {
+    for (uint32_t i = begin; i < end; ++i) {
+        points[i] = descend(start.at(i), M, eta, params);
+    }
+}
+
+// L lanes per vector, K independent vectors in flight to cover the latency
+// of the serial dependency chain through x.
+template <int L, int K>
+__attribute__((always_inline)) GD_EXACT_FP inline void kernel_vec(float *points, GdStart start, uint32_t begin, uint32_t end,
+                                                      uint32_t M, float eta, const PolyParams* params) {
+    typedef float vec __attribute__((vector_size(L * sizeof(float))));
+    const float a4 = 4 * params->a, b3 = 3 * params->b, c2 = 2 * params->c, d = params->d;
+    uint32_t i = begin;
+    for (; i + L * K <= end; i += L * K) {
+        vec x[K] = {};
+        for (int k = 0; k < K; ++k)
+            for (int l = 0; l < L; ++l)
+                x[k][l] = start.at(i + k * L + l);
         for (uint32_t j = 0; j < M; ++j) {
-            float grad = poly_gradient(x, params);
-            x -= eta * grad;
+            for (int k = 0; k < K; ++k) {
+                vec grad = a4 * x[k] * x[k] * x[k] + b3 * x[k] * x[k] + c2 * x[k] + d;
+                x[k] -= eta * grad;
+            }
+        }
+        for (int k = 0; k < K; ++k)
+            for (int l = 0; l < L; ++l)
+                points[i + k * L + l] = x[k][l];
+    }
+    kernel_scalar(points, start, i, end, M, eta, params);
+}
+
+#define GD_DEFINE_KERNEL(name, target, L, K)                                                    \
+    target GD_EXACT_FP static void name(float *points, GdStart start, uint32_t begin, uint32_t end,       \
+                            uint32_t M, float eta, const PolyParams* params) {                 \
+        kernel_vec<L, K>(points, start, begin, end, M, eta, params);                           \
+    }
+
+// 128-bit vectors are baseline on both aarch64 (NEON) and x86_64 (SSE2).
+GD_DEFINE_KERNEL(kernel_v128x2, , 4, 2)
+GD_DEFINE_KERNEL(kernel_v128x4, , 4, 4)
+GD_DEFINE_KERNEL(kernel_v128x8, , 4, 8)
+#if defined(__x86_64__)
+GD_DEFINE_KERNEL(kernel_avx2x2, __attribute__((target("avx2"))), 8, 2)
+GD_DEFINE_KERNEL(kernel_avx2x4, __attribute__((target("avx2"))), 8, 4)
+GD_DEFINE_KERNEL(kernel_avx512x1, __attribute__((target("avx512f"))), 16, 1)
+GD_DEFINE_KERNEL(kernel_avx512x2, __attribute__((target("avx512f"))), 16, 2)
+GD_DEFINE_KERNEL(kernel_avx512x4, __attribute__((target("avx512f"))), 16, 4)
+#endif
+
+enum GdIsa { ISA_BASE, ISA_AVX2, ISA_AVX512 };
+
+struct GdKernel {
+    const char *name;
+    GdIsa isa;
+    GdKernelFn fn;
+};
+
+static const GdKernel kernels[] = {
+    {"scalar", ISA_BASE, kernel_scalar},
+    {"v128x2", ISA_BASE, kernel_v128x2},
+    {"v128x4", ISA_BASE, kernel_v128x4},
+    {"v128x8", ISA_BASE, kernel_v128x8},
+#if defined(__x86_64__)
+    {"avx2x2", ISA_AVX2, kernel_avx2x2},
+    {"avx2x4", ISA_AVX2, kernel_avx2x4},
+    {"avx512x1", ISA_AVX512, kernel_avx512x1},
+    {"avx512x2", ISA_AVX512, kernel_avx512x2},
+    {"avx512x4", ISA_AVX512, kernel_avx512x4},
+#endif
+};
+static const int n_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+static GdIsa detect_isa() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2")) return ISA_AVX2;
+#endif
+    return ISA_BASE;
+}
+
+static const char *isa_name(GdIsa isa) {
+#if defined(__aarch64__)
+    (void)isa;
+    return "aarch64-neon";
+#elif defined(__x86_64__)
+    return isa == ISA_AVX512 ? "x86_64-avx512" : isa == ISA_AVX2 ? "x86_64-avx2" : "x86_64-sse2";
+#else
+    (void)isa;
+    return "generic";
+#endif
+}
+
+static const char *default_tune_file() {
+    const char *env = std::getenv("GD_TUNE_FILE");
+    return env ? env : ".gd_tune";
+}
+
+static int find_kernel(const char *name) {
+    for (int k = 0; k < n_kernels; ++k)
+        if (std::strcmp(kernels[k].name, name) == 0) return k;
+    return -1;
+}
+
+static int selected = -1;
+
+// Cache format, one line: "gd-tune v1 <cpu> <kernel>". Entries written on a
+// different cpu type are ignored.
+static int read_tune_cache(const char *path, GdIsa isa) {
+    FILE *f = std::fopen(path, "r");
+    if (!f) return -1;
+    char cpu[64], name[64];
+    int k = -1;
+    if (std::fscanf(f, "gd-tune v1 %63s %63s", cpu, name) == 2 && std::strcmp(cpu, isa_name(isa)) == 0) {
+        k = find_kernel(name);
+        if (k >= 0 && kernels[k].isa > isa) k = -1;
+    }
+    std::fclose(f);
+    return k;
+}
+
+// GD_KERNEL overrides, then the tune cache, then the widest supported ISA.
+static int pick_kernel() {
+    GdIsa isa = detect_isa();
+    if (const char *env = std::getenv("GD_KERNEL")) {
+        int k = find_kernel(env);
+        if (k >= 0 && kernels[k].isa <= isa) return k;
+        std::fprintf(stderr, "Warning: GD_KERNEL=%s is unknown or unsupported here, ignored\n", env);
+    }
+    int k = read_tune_cache(default_tune_file(), isa);
+    if (k >= 0) return k;
+    const char *fallback = isa == ISA_AVX512 ? "avx512x2" : isa == ISA_AVX2 ? "avx2x4" : "v128x8";
+    return find_kernel(fallback);
+}
+
+const char *gd_kernel_name() {
+    if (selected < 0) selected = pick_kernel();
+    return kernels[selected].name;
+}
+
+// Static split of [0, N) across the team.
+static void descend_all(const GdKernel &kernel, float *points, GdStart start, uint32_t N, uint32_t M, float eta,
+                        const PolyParams* params, GdProfile* profile) {
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        uint32_t begin = (uint64_t)N * tid / nthreads;
+        uint32_t end = (uint64_t)N * (tid + 1) / nthreads;
+        double t0 = omp_get_wtime();
+
+        kernel.fn(points, start, begin, end, M, eta, params);
+
+        if (profile) {
+            if (tid < profile->max_threads)
+                profile->thread_seconds[tid] = omp_get_wtime() - t0;
+            if (tid == 0)
+                profile->threads_used = nthreads;
         }
-        points[i] = x;
     }
+}
+
+void gradient_descent(float *points, uint32_t N, uint32_t M, float eta, const PolyParams* params,
+                      GdProfile* profile) {
+    gd_kernel_name();
+    GdStart start = {points, 0, 0};
+    descend_all(kernels[selected], points, start, N, M, eta, params, profile);
+}
+
+void gradient_descent_grid(float *points, float a, float interval, uint32_t N, uint32_t M, float eta,
+                           const PolyParams* params, GdProfile* profile) {
+    gd_kernel_name();
+    GdStart start = {nullptr, a, interval};
+    descend_all(kernels[selected], points, start, N, M, eta, params, profile);
+}
+
+const char *gd_tune(FILE *log) {
+    // Short sample: enough blocks per thread for the widest kernel, few
+    // enough updates to finish in well under a second per variant.
+    const uint32_t N = 2048 * omp_get_max_threads(), M = 1024;
+    const float a = -2, b = 2, eta = 0.001f;
+    const PolyParams params(0.25f, -0.1f, -1.0f, 0.2f);
+    const float interval = (b - a) / (N - 1);
+    GdStart start = {nullptr, a, interval};
+    GdIsa isa = detect_isa();
+
+    std::vector<float> ref(N), out(N);
+    descend_all(kernels[0], ref.data(), start, N, M, eta, &params, nullptr);
+
+    int best = 0;
+    double best_t = 0;
+    for (int k = 0; k < n_kernels; ++k) {
+        if (kernels[k].isa > isa) continue;
+        double t = 0;
+        for (int rep = 0; rep < 3; ++rep) {
+            double t0 = omp_get_wtime();
+            descend_all(kernels[k], out.data(), start, N, M, eta, &params, nullptr);
+            double dt = omp_get_wtime() - t0;
+            if (rep == 0 || dt < t) t = dt;
+        }
+        bool exact = std::memcmp(ref.data(), out.data(), N * sizeof(float)) == 0;
+        if (log)
+            std::fprintf(log, "  %-10s %9.3f ms %s\n", kernels[k].name, t * 1e3, exact ? "" : "(mismatch, skipped)");
+        if (exact && (k == 0 || t < best_t)) {
+            best = k;
+            best_t = t;
+        }
+    }
+
+    selected = best;
+    const char *path = default_tune_file();
+    FILE *f = std::fopen(path, "w");
+    if (f) {
+        std::fprintf(f, "gd-tune v1 %s %s\n", isa_name(isa), kernels[best].name);
+        std::fclose(f);
+    } else if (log) {
+        std::fprintf(log, "Warning: unable to write tune cache %s\n", path);
+    }
+    if (log)
+        std::fprintf(log, "Selected %s on %s, cached in %s\n", kernels[best].name, isa_name(isa), path);
+    return kernels[best].name;
 }
\ No newline at end of file
@@ -2,14 +2,46 @@
 #define GD_H
 
 #include <string>
+#include <cstdint>
+#include <cstdio>
 
 struct PolyParams {
     float a, b, c, d;
     PolyParams(float a, float b, float c, float d) : a(a), b(b), c(c), d(d) {}
 };
 
+// Floating-point operations per update as the kernel evaluates it (the
+// reference output fixes the operation order, so it is not in Horner form):
+// g = 4a*x*x*x + 3b*x*x + 2c*x + d is 6 mul + 3 add with the coefficient
+// products hoisted, x -= eta*g is 2 more.
+const int GD_FLOPS_PER_UPDATE = 11;
 
+// Optional instrumentation filled by gradient_descent. thread_seconds must
+// hold max_threads entries; threads_used is set to the team size actually run.
+struct GdProfile {
+    double *thread_seconds;
+    int max_threads;
+    int threads_used;
+};
+
+void gradient_descent(float *points, uint32_t N, uint32_t M, float eta, const PolyParams* params,
+                      GdProfile* profile = nullptr);
+
+// Fused initialization: each thread generates its own starting points
+// x_i = a + i * interval (same formula as the driver) in registers and only
+// stores the final positions, so points need not be initialized beforehand.
+void gradient_descent_grid(float *points, float a, float interval, uint32_t N, uint32_t M, float eta,
+                           const PolyParams* params, GdProfile* profile = nullptr);
+
+// Runtime kernel dispatch. gd.cpp holds several variants of the update loop
+// (vector width x interleave); the first call picks one from, in order,
+// $GD_KERNEL, the tune cache ($GD_TUNE_FILE, default ./.gd_tune) and the
+// widest vector ISA the CPU supports. Returns the selected variant's name.
+const char *gd_kernel_name();
 
-void gradient_descent(float *points, uint32_t N, uint32_t M, float eta, const PolyParams* params);
+// Benchmarks every supported variant on a short sample, selects the fastest
+// one whose output is bit-identical to the scalar kernel, writes it to the
+// tune cache and returns its name. Progress goes to log when non-null.
+const char *gd_tune(FILE *log);
 
 #endif // GD_H
\ No newline at end of file
@@ -2,19 +2,164 @@
 #include <chrono>
 #include <fstream>
 #include <string>
-#include <iomanip> 
+#include <iomanip>
+#include <charconv>
+#include <limits>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <omp.h>
 
 #include "gd.h"
 
 
+// Longest "%.9g" float is "-1.17549435e-38": 15 chars, plus the newline.
+static const size_t MAX_POINT_CHARS = 16;
+
+// Format every point into one buffer and hand it to the stream in a single
+// write. Output is byte-identical to `outfile << setprecision(max_digits10)`.
+static bool write_points_text(std::ofstream& outfile, const float* points, uint32_t N) {
+    std::vector<char> buf((size_t)N * MAX_POINT_CHARS);
+    char* p = buf.data();
+    char* end = p + buf.size();
+    for (uint32_t i = 0; i < N; ++i) {
+        auto res = std::to_chars(p, end, points[i], std::chars_format::general,
+                                 std::numeric_limits<float>::max_digits10);
+        p = res.ptr;
+        *p++ = '\n';
+    }
+    outfile.write(buf.data(), p - buf.data());
+    return bool(outfile);
+}
+
+// Raw native-endian float32 dump, N * 4 bytes, no header.
+static bool write_points_binary(std::ofstream& outfile, const float* points, uint32_t N) {
+    outfile.write(reinterpret_cast<const char*>(points), (std::streamsize)N * sizeof(float));
+    return bool(outfile);
+}
+
+
+enum ReportMode { REPORT_NONE, REPORT_TEXT, REPORT_JSON };
+
+static bool parse_report_mode(const char* s, ReportMode* mode) {
+    if (std::strcmp(s, "text") == 0 || std::strcmp(s, "1") == 0) *mode = REPORT_TEXT;
+    else if (std::strcmp(s, "json") == 0) *mode = REPORT_JSON;
+    else if (std::strcmp(s, "0") == 0 || s[0] == '\0') *mode = REPORT_NONE;
+    else return false;
+    return true;
+}
+
+static double ms_between(std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1) {
+    return std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
+
+// tune is 0 unless --tune ran before solving.
+struct PhaseTimes {
+    double tune, parse, init, compute, output;
+};
+
+// Per-phase report, written to stderr so stdout keeps ending with "Time: Xms".
+static void print_report(ReportMode mode, uint32_t N, uint32_t M, const PhaseTimes& t, const GdProfile& prof,
+                         const char* kernel) {
+    double updates = (double)N * M;
+    double compute_s = t.compute * 1e-3;
+    double updates_per_s = compute_s > 0 ? updates / compute_s : 0;
+    double gflops = updates_per_s * GD_FLOPS_PER_UPDATE * 1e-9;
+    double total = t.tune + t.parse + t.init + t.compute + t.output;
+
+    int nt = prof.threads_used < prof.max_threads ? prof.threads_used : prof.max_threads;
+    double tmax = 0, tsum = 0;
+    for (int i = 0; i < nt; ++i) {
+        tsum += prof.thread_seconds[i];
+        if (prof.thread_seconds[i] > tmax) tmax = prof.thread_seconds[i];
+    }
+    // max/mean busy time: 1.0 is perfect balance
+    double imbalance = tsum > 0 ? tmax * nt / tsum : 1.0;
+
+    if (mode == REPORT_JSON) {
+        std::fprintf(stderr, "{\"N\": %u, \"M\": %u, \"threads\": %d, \"kernel\": \"%s\", ", N, M, nt, kernel);
+        std::fprintf(stderr, "\"phases_ms\": {\"tune\": %.3f, \"parse\": %.3f, \"init\": %.3f, \"compute\": %.3f, \"output\": %.3f, \"total\": %.3f}, ",
+                     t.tune, t.parse, t.init, t.compute, t.output, total);
+        std::fprintf(stderr, "\"updates_per_s\": %.6e, \"flops_per_update\": %d, \"gflops\": %.3f, ",
+                     updates_per_s, GD_FLOPS_PER_UPDATE, gflops);
+        std::fprintf(stderr, "\"thread_ms\": [");
+        for (int i = 0; i < nt; ++i)
+            std::fprintf(stderr, "%s%.3f", i ? ", " : "", prof.thread_seconds[i] * 1e3);
+        std::fprintf(stderr, "], \"imbalance\": %.4f}\n", imbalance);
+    } else {
+        std::fprintf(stderr, "Report: N=%u M=%u threads=%d kernel=%s\n", N, M, nt, kernel);
+        if (t.tune > 0)
+            std::fprintf(stderr, "  tune    %10.3f ms\n", t.tune);
+        std::fprintf(stderr, "  parse   %10.3f ms\n", t.parse);
+        std::fprintf(stderr, "  init    %10.3f ms\n", t.init);
+        std::fprintf(stderr, "  compute %10.3f ms\n", t.compute);
+        std::fprintf(stderr, "  output  %10.3f ms\n", t.output);
+        std::fprintf(stderr, "  total   %10.3f ms\n", total);
+        std::fprintf(stderr, "  updates/s %.4e, %.3f GFLOP/s (%d flops/update)\n",
+                     updates_per_s, gflops, GD_FLOPS_PER_UPDATE);
+        std::fprintf(stderr, "  thread ms:");
+        for (int i = 0; i < nt; ++i)
+            std::fprintf(stderr, " %.3f", prof.thread_seconds[i] * 1e3);
+        std::fprintf(stderr, "\n  imbalance (max/mean) %.4f\n", imbalance);
+    }
+}
+
+
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <input_file> <output_file>" << std::endl;
+    bool binary_output = false;
+    bool tune = false;
+    ReportMode report = REPORT_NONE;
+    if (const char* env = std::getenv("GD_REPORT")) {
+        if (!parse_report_mode(env, &report)) {
+            std::cerr << "Error: GD_REPORT must be one of text, json, 1, 0" << std::endl;
+            return 1;
+        }
+    }
+    const char* positional[2];
+    int n_positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--binary") == 0) {
+            binary_output = true;
+        } else if (std::strcmp(argv[i], "--tune") == 0) {
+            tune = true;
+        } else if (std::strcmp(argv[i], "--report") == 0) {
+            report = REPORT_TEXT;
+        } else if (std::strncmp(argv[i], "--report=", 9) == 0) {
+            if (!parse_report_mode(argv[i] + 9, &report)) {
+                n_positional = -1;
+                break;
+            }
+        } else if (n_positional < 2 && argv[i][0] != '-') {
+            positional[n_positional++] = argv[i];
+        } else {
+            n_positional = -1;
+            break;
+        }
+    }
+    if (tune && n_positional == 0) {
+        std::cout << "Tuning gradient kernels" << std::endl;
+        gd_tune(stdout);
+        return 0;
+    }
+    if (n_positional != 2) {
+        std::cerr << "Usage: " << argv[0] << " [--binary] [--report[=text|json]] [--tune] <input_file> <output_file>" << std::endl;
+        std::cerr << "       " << argv[0] << " --tune" << std::endl;
         return 1;
     }
+    // --tune with input files: tune first and solve with the selected kernel;
+    // the tune log goes to stderr so stdout keeps its usual format
+    double tune_ms = 0;
+    if (tune) {
+        auto t_tune = std::chrono::steady_clock::now();
+        std::fprintf(stderr, "Tuning gradient kernels\n");
+        gd_tune(stderr);
+        tune_ms = ms_between(t_tune, std::chrono::steady_clock::now());
+    }
+    auto t_start = std::chrono::steady_clock::now();
 
-    std::string input_filepath = argv[1];
-    std::string output_filepath = argv[2];
+    std::string input_filepath = positional[0];
+    std::string output_filepath = positional[1];
 
     std::ifstream infile(input_filepath);
     if (!infile) {
@@ -29,36 +174,51 @@ int main(int argc, char* argv[]) {
     infile >> a >> b >> N >> M >> eta;
     infile >> params.a >> params.b >> params.c >> params.d;
     infile.close();
+    auto t_parsed = std::chrono::steady_clock::now();
 
-    // initialize points
+    // starting points a + i * interval are generated inside the compute pass,
+    // so the array is first touched by the thread that owns each chunk
     float *points = new float[N];
     float interval = (b - a) / (N - 1);
-    for (uint32_t i = 0; i < N; ++i) {
-        points[i] = a + i * interval;
-    }
+
+    auto t_init = std::chrono::steady_clock::now();
 
     std::cout << "Search params: " << a << " " << b << " " << N << " " << M << " " << eta << std::endl;
     std::cout << "Function params: " << params.a << " " << params.b << " " << params.c << " " << params.d << std::endl;
 
+    std::vector<double> thread_seconds(omp_get_max_threads(), 0.0);
+    GdProfile profile = {thread_seconds.data(), (int)thread_seconds.size(), 0};
+    const char* kernel = gd_kernel_name();
+
     auto t1 = std::chrono::steady_clock::now();
-    gradient_descent(points, N, M, eta, &params);
+    gradient_descent_grid(points, a, interval, N, M, eta, &params, report != REPORT_NONE ? &profile : nullptr);
     auto t2 = std::chrono::steady_clock::now();
     uint32_t d1 = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
     std::cout << "Time: " << d1 << "ms" << std::endl;
 
 
     // write to output file
-    std::ofstream outfile(output_filepath);
+    std::ofstream outfile(output_filepath, std::ios::binary);
     if (!outfile) {
         std::cerr << "Error: Unable to open output file " << output_filepath << std::endl;
         delete[] points;
         return 1;
     }
-    outfile << std::setprecision(std::numeric_limits<float>::max_digits10);
-    for (uint32_t i = 0; i < N; ++i) {
-        outfile << points[i] << std::endl;
-    }
+    bool written = binary_output ? write_points_binary(outfile, points, N)
+                                 : write_points_text(outfile, points, N);
     outfile.close();
+    if (!written) {
+        std::cerr << "Error: Unable to write output file " << output_filepath << std::endl;
+        delete[] points;
+        return 1;
+    }
+    auto t_output = std::chrono::steady_clock::now();
+
+    if (report != REPORT_NONE) {
+        PhaseTimes phases = {tune_ms, ms_between(t_start, t_parsed), ms_between(t_parsed, t_init),
+                             ms_between(t1, t2), ms_between(t2, t_output)};
+        print_report(report, N, M, phases, profile, kernel);
+    }
 
 
     delete[] points;
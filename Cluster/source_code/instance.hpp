@@ -0,0 +1,186 @@
+#pragma once
+
+// Binary instance format for recorded server lists:
+//
+//   InstanceHeader (64 bytes)
+//   weight column    at weight_offset,   n values of weight_bytes each
+//   capactiy column  at capactiy_offset, n values of capactiy_bytes each
+//
+// 4-byte columns hold unsigned values, 8-byte columns signed ones. Both
+// columns start on a 2 MiB boundary so they can be backed by huge pages.
+// Native byte order; the magic doubles as an endianness check.
+
+#include "solver.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "omp.h"
+
+const char INSTANCE_MAGIC[8] = {'C', 'L', 'U', 'S', 'T', 'E', 'R', '1'};
+const uint32_t INSTANCE_VERSION = 1;
+const uint64_t INSTANCE_ALIGN = 2ull << 20;
+
+struct InstanceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t weight_bytes, capactiy_bytes;
+    uint32_t reserved;
+    int64_t n;
+    int64_t min_key, max_key;
+    uint64_t weight_offset, capactiy_offset;
+};
+
+inline uint64_t instance_align(uint64_t x) { return (x + INSTANCE_ALIGN - 1) / INSTANCE_ALIGN * INSTANCE_ALIGN; }
+
+inline bool is_instance_file(const char *path) {
+    char magic[8];
+    FILE *f = std::fopen(path, "rb");
+    if (!f) return false;
+    bool ok = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) && std::memcmp(magic, INSTANCE_MAGIC, 8) == 0;
+    std::fclose(f);
+    return ok;
+}
+
+inline long long column_value(const void *column, uint32_t bytes, long long i) {
+    return bytes == 4 ? (long long)static_cast<const uint32_t *>(column)[i] : (long long)static_cast<const int64_t *>(column)[i];
+}
+
+// Narrowest column width that holds every value of one field.
+inline uint32_t column_bytes(long long min_value, long long max_value) {
+    return min_value >= 0 && max_value <= (long long)UINT32_MAX ? 4 : 8;
+}
+
+template <typename T>
+bool write_column(FILE *f, const Server *servers, long long n, long long Server::*field) {
+    const long long CHUNK = 1 << 20;
+    std::vector<T> buf(CHUNK);
+    for (long long i = 0; i < n; i += CHUNK) {
+        long long count = std::min(CHUNK, n - i);
+        for (long long k = 0; k < count; ++k)
+            buf[k] = (T)(servers[i + k].*field);
+        if (std::fwrite(buf.data(), sizeof(T), count, f) != (size_t)count) return false;
+    }
+    return true;
+}
+
+inline bool pad_to(FILE *f, uint64_t size) {
+    return std::fseek(f, size - 1, SEEK_SET) == 0 && std::fputc(0, f) != EOF;
+}
+
+inline bool write_instance(const char *path, const Server *servers, long long n) {
+    KeyStats st = key_stats(servers, n);
+    long long min_c = LLONG_MAX, max_c = LLONG_MIN;
+    #pragma omp parallel for reduction(min : min_c) reduction(max : max_c)
+    for (long long i = 0; i < n; ++i) {
+        min_c = std::min(min_c, servers[i].capactiy);
+        max_c = std::max(max_c, servers[i].capactiy);
+    }
+
+    InstanceHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, INSTANCE_MAGIC, 8);
+    h.version = INSTANCE_VERSION;
+    h.n = n;
+    h.min_key = n > 0 ? st.min_key : 0;
+    h.max_key = n > 0 ? st.max_key : 0;
+    h.weight_bytes = n > 0 ? column_bytes(st.min_weight, st.max_weight) : 4;
+    h.capactiy_bytes = n > 0 ? column_bytes(min_c, max_c) : 4;
+    h.weight_offset = INSTANCE_ALIGN;
+    h.capactiy_offset = instance_align(h.weight_offset + (uint64_t)n * h.weight_bytes);
+
+    FILE *f = std::fopen(path, "wb");
+    if (!f) return false;
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1 && std::fseek(f, h.weight_offset, SEEK_SET) == 0;
+    ok = ok && (h.weight_bytes == 4 ? write_column<uint32_t>(f, servers, n, &Server::weight)
+                                    : write_column<int64_t>(f, servers, n, &Server::weight));
+    ok = ok && std::fseek(f, h.capactiy_offset, SEEK_SET) == 0;
+    ok = ok && (h.capactiy_bytes == 4 ? write_column<uint32_t>(f, servers, n, &Server::capactiy)
+                                      : write_column<int64_t>(f, servers, n, &Server::capactiy));
+    // a trailing empty column still has to exist in the file
+    ok = ok && (n > 0 || pad_to(f, h.capactiy_offset + 1));
+    return std::fclose(f) == 0 && ok;
+}
+
+// Whether n values of bytes each starting at offset lie inside a file of
+// size bytes; written so a corrupt header cannot wrap the arithmetic.
+inline bool column_fits(uint64_t offset, int64_t n, uint32_t bytes, uint64_t size) {
+    return offset <= size && (uint64_t)n <= (size - offset) / bytes;
+}
+
+// A mapped instance file. Huge pages are requested where the kernel
+// supports them for file mappings, then the mapping is populated up front
+// so page faults stay out of the timed region.
+struct MappedInstance {
+    InstanceHeader header;
+    const void *weight, *capactiy;
+    void *base;
+    size_t length;
+
+    MappedInstance() : weight(nullptr), capactiy(nullptr), base(MAP_FAILED), length(0) {}
+    ~MappedInstance() {
+        if (base != MAP_FAILED) munmap(base, length);
+    }
+    MappedInstance(const MappedInstance &) = delete;
+    MappedInstance &operator=(const MappedInstance &) = delete;
+
+    long long n() const { return header.n; }
+    Server at(long long i) const {
+        return Server(column_value(weight, header.weight_bytes, i), column_value(capactiy, header.capactiy_bytes, i));
+    }
+
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat sb;
+        bool ok = fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof(header) &&
+                  pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+        ok = ok && std::memcmp(header.magic, INSTANCE_MAGIC, 8) == 0 && header.version == INSTANCE_VERSION;
+        ok = ok && (header.weight_bytes == 4 || header.weight_bytes == 8) &&
+             (header.capactiy_bytes == 4 || header.capactiy_bytes == 8) && header.n >= 0;
+        ok = ok && column_fits(header.weight_offset, header.n, header.weight_bytes, sb.st_size) &&
+             column_fits(header.capactiy_offset, header.n, header.capactiy_bytes, sb.st_size);
+        if (ok) {
+            length = sb.st_size;
+            base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = base != MAP_FAILED;
+        }
+        close(fd);
+        if (!ok) return false;
+        // the hint must precede the first fault, so no MAP_POPULATE above
+#ifdef MADV_HUGEPAGE
+        madvise(base, length, MADV_HUGEPAGE);
+#endif
+        populate();
+        weight = static_cast<const char *>(base) + header.weight_offset;
+        capactiy = static_cast<const char *>(base) + header.capactiy_offset;
+        return true;
+    }
+
+    // MADV_POPULATE_READ (Linux 5.14+) where available, else one read per page.
+    void populate() const {
+#ifdef MADV_POPULATE_READ
+        if (madvise(base, length, MADV_POPULATE_READ) == 0) return;
+#endif
+        long page = sysconf(_SC_PAGESIZE);
+        const volatile char *p = static_cast<const char *>(base);
+        for (size_t off = 0; off < length; off += page)
+            (void)p[off];
+    }
+
+    // Materializes the columns as Servers using the solver's slice split,
+    // so each thread first-touches the part of servers it will scan.
+    void to_servers(Server *servers) const {
+        long long count = n();
+        #pragma omp parallel
+        {
+            int tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+            long long end = slice_begin(count, tid + 1, nthreads);
+            for (long long i = slice_begin(count, tid, nthreads); i < end; ++i)
+                servers[i] = at(i);
+        }
+    }
+};
@@ -1,9 +1,12 @@
 #include "solver.hpp"
+#include "instance.hpp"
+#include "philox.hpp"
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <sys/time.h>
 #include <random>
+#include <cstring>
 #include "omp.h"
 
 const long long MOD = 998244353;
@@ -20,17 +23,208 @@ inline double timer() {
 }
 
 
+// Fills servers[0, n) from the per-thread seeds of a random.*.in file.
+void generate_servers(Server *servers, long long n, const int *random_seed) {
+    int nthreads, tid;
+
+    #pragma omp parallel private(tid)
+    { 
+        std::mt19937 gen;
+        std::uniform_int_distribution<> dis_w(1, std::min(1000000ll, n));
+        std::uniform_int_distribution<long long> dis_c(1, std::min((long long)1e12, n));
+        nthreads = omp_get_num_threads();
+        tid = omp_get_thread_num();
+        gen = std::mt19937(random_seed[tid]);
+        // same split as the solver's passes, see slice_begin in solver.hpp
+        for(long long i = slice_begin(n, tid, nthreads); i < slice_begin(n, tid + 1, nthreads); ++i){
+            servers[i] = Server(dis_w(gen), dis_c(gen));
+        }
+    }
+}
+
+// Generator behind the seed file: the original per-thread mt19937 streams,
+// or the counter-based Philox mode (--rng=philox, see philox.hpp), whose
+// instance does not depend on the thread count.
+enum Rng { RNG_MT19937, RNG_PHILOX };
+
+// Servers each thread generates before handing them to the streaming solver.
+const long long STREAM_CHUNK = 1 << 16;
+
+// --stream: each thread draws its slice in chunks straight into a
+// StreamingSolver, so no n-sized array exists. Same seeds, same per-thread
+// sequence, hence the same answer as the in-memory path. Returns false if a
+// chunk fell outside the histogram (nothing is answered then).
+bool generate_and_stream(long long n, const int *random_seed, Rng rng, long long *ans) {
+    long long w_max = std::min(1000000ll, n), c_max = std::min((long long)1e12, n);
+    StreamingSolver solver(2, w_max + c_max);
+    PhiloxKey key = philox_key(random_seed);
+    bool in_range = true;
+    #pragma omp parallel
+    {
+        std::uniform_int_distribution<> dis_w(1, w_max);
+        std::uniform_int_distribution<long long> dis_c(1, c_max);
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        std::mt19937 gen(random_seed[tid]);
+        std::vector<Server> chunk(STREAM_CHUNK);
+        long long end = slice_begin(n, tid + 1, nthreads);
+        for (long long i = slice_begin(n, tid, nthreads); i < end; i += STREAM_CHUNK) {
+            long long count = std::min(STREAM_CHUNK, end - i);
+            if (rng == RNG_PHILOX) {
+                philox_servers(chunk.data(), i, count, key, w_max, c_max);
+            } else {
+                for (long long k = 0; k < count; ++k)
+                    chunk[k] = Server(dis_w(gen), dis_c(gen));
+            }
+            if (!solver.add_concurrent(chunk.data(), count)) {
+                #pragma omp atomic write
+                in_range = false;
+                break;
+            }
+        }
+    }
+    if (in_range) *ans = solver.answer();
+    return in_range;
+}
+
+// --stream on an instance file: the header's key bounds size the histogram
+// and each thread converts its slice of the mapped columns chunk by chunk.
+// Returns false if a key lies outside the header's bounds.
+bool stream_instance(const MappedInstance &inst, long long *ans) {
+    long long n = inst.n();
+    StreamingSolver solver(inst.header.min_key, inst.header.max_key);
+    bool in_range = true;
+    #pragma omp parallel
+    {
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        std::vector<Server> chunk(STREAM_CHUNK);
+        long long end = slice_begin(n, tid + 1, nthreads);
+        for (long long i = slice_begin(n, tid, nthreads); i < end; i += STREAM_CHUNK) {
+            long long count = std::min(STREAM_CHUNK, end - i);
+            for (long long k = 0; k < count; ++k)
+                chunk[k] = inst.at(i + k);
+            if (!solver.add_concurrent(chunk.data(), count)) {
+                #pragma omp atomic write
+                in_range = false;
+                break;
+            }
+        }
+    }
+    if (in_range) *ans = solver.answer();
+    return in_range;
+}
+
+// --bench: sweeps n over powers of ten from 1e5 up to the seed file's n and
+// the thread count over powers of two up to OMP_NUM_THREADS, reporting the
+// best of BENCH_REPS solves per point as CSV. Instances come from the
+// Philox generator, so every thread count solves the same servers.
+const int BENCH_REPS = 3;
+
+bool run_benchmark(long long n_max, const int *random_seed, FILE *csv) {
+    int max_threads = omp_get_max_threads();
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+    std::vector<long long> sizes;
+    for (long long n = 100000; n < n_max; n *= 10)
+        sizes.push_back(n);
+    sizes.push_back(n_max);
+
+    Server *servers = new Server[n_max];
+    std::fprintf(csv, "n,threads,path,project_s,bin_s,scan_s,reduce_s,total_s,gb_per_s,speedup,efficiency,answer\n");
+    for (long long n : sizes) {
+        omp_set_num_threads(max_threads);
+        generate_servers_philox(servers, n, random_seed);
+        double t1 = 0;
+        for (int threads : thread_counts) {
+            omp_set_num_threads(threads);
+            SolveProfile best = {"", 0, 0, 0, 0};
+            double best_total = 0;
+            long long ans = 0;
+            for (int rep = 0; rep < BENCH_REPS; ++rep) {
+                SolveProfile prof = {"", 0, 0, 0, 0};
+                TIC(1);
+                ans = solve(servers, n, &prof);
+                double total = timer() - timers[1];
+                if (rep == 0 || total < best_total) {
+                    best = prof;
+                    best_total = total;
+                }
+            }
+            if (threads == 1) t1 = best_total;
+            double speedup = t1 > 0 ? t1 / best_total : 0;
+            std::fprintf(csv, "%lld,%d,%s,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f,%.3f,%lld\n", n, threads, best.path,
+                         best.project, best.bin, best.scan, best.reduce, best_total,
+                         best_total > 0 ? n * sizeof(Server) / best_total * 1e-9 : 0, speedup, speedup / threads, ans);
+            std::fflush(csv);
+        }
+    }
+    omp_set_num_threads(max_threads);
+    delete [] servers;
+    return true;
+}
+
 using namespace std;
 int main (int argc, char* argv[]) {
     long long n;
-    if (argc!= 2){
-        std::cout<<"Usage: "<< argv[0] << " <file_name>"<<endl;
+    bool stream = false, convert = false, bench = false, usage = false;
+    Rng rng = RNG_MT19937;
+    const char *positional[2];
+    int n_positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--stream") == 0) stream = true;
+        else if (strcmp(argv[i], "--convert") == 0) convert = true;
+        else if (strcmp(argv[i], "--bench") == 0) bench = true;
+        else if (strcmp(argv[i], "--rng=mt19937") == 0) rng = RNG_MT19937;
+        else if (strcmp(argv[i], "--rng=philox") == 0) rng = RNG_PHILOX;
+        else if (argv[i][0] != '-' && n_positional < 2) positional[n_positional++] = argv[i];
+        else usage = true;
+    }
+    // --convert takes an output file, --bench an optional CSV file
+    int min_positional = convert ? 2 : 1, max_positional = convert || bench ? 2 : 1;
+    if (usage || stream + convert + bench > 1 || n_positional < min_positional || n_positional > max_positional){
+        std::cout<<"Usage: "<< argv[0] << " [--stream] [--rng=mt19937|philox] <file_name>"<<endl;
+        std::cout<<"       "<< argv[0] << " [--rng=mt19937|philox] --convert <seed_file> <instance_file>"<<endl;
+        std::cout<<"       "<< argv[0] << " --bench <seed_file> [csv_file]"<<endl;
         return 1;
     }
+    const char *file_name = positional[0];
+
+    // recorded instance: mapped columns, no generation
+    if (!convert && !bench && is_instance_file(file_name)) {
+        MappedInstance inst;
+        if (!inst.open(file_name)) {
+            std::cout<< "Invalid instance file "<< file_name << endl;
+            return 1;
+        }
+        n = inst.n();
+        long long ans;
+        if (stream) {
+            TIC(0);
+            bool ok = stream_instance(inst, &ans);
+            TOC(0);
+            if (!ok) {
+                std::cout<< "Key outside the header's range in "<< file_name << endl;
+                return 1;
+            }
+        } else {
+            Server* servers = new Server[n];
+            inst.to_servers(servers);
+            TIC(0);
+            ans = solve(servers, n);
+            TOC(0);
+            delete [] servers;
+        }
+        cout << "solve Time " << total_t[0] << endl;
+        cout << ans << endl;
+        return 0;
+    }
     
-    ifstream file(argv[1]);
+    ifstream file(file_name);
     if (!file.is_open()) {
-        std::cout<< "Unable to open file "<< argv[1] << endl;
+        std::cout<< "Unable to open file "<< file_name << endl;
         return 1;
     }
     file >> n;
@@ -38,20 +232,44 @@ int main (int argc, char* argv[]) {
     for(int i=0; i < thread_num; i++){
         file >> random_seed[i];
     }
+    if (bench) {
+        FILE *csv = n_positional == 2 ? std::fopen(positional[1], "w") : stdout;
+        if (!csv) {
+            std::cout<< "Unable to write "<< positional[1] << endl;
+            return 1;
+        }
+        run_benchmark(n, random_seed, csv);
+        if (csv != stdout) std::fclose(csv);
+        return 0;
+    }
+    if (stream) {
+        // generation and solving are interleaved, so both are timed
+        long long ans;
+        TIC(0);
+        bool ok = generate_and_stream(n, random_seed, rng, &ans);
+        TOC(0);
+        if (!ok) {
+            std::cout<< "Generated key outside the streaming histogram"<< endl;
+            return 1;
+        }
+        cout << "solve Time " << total_t[0] << endl;
+        cout << ans << endl;
+        return 0;
+    }
     Server* servers = new Server[n];
-    int nthreads, tid;
+    if (rng == RNG_PHILOX)
+        generate_servers_philox(servers, n, random_seed);
+    else
+        generate_servers(servers, n, random_seed);
 
-    #pragma omp parallel private(tid)
-    { 
-        std::mt19937 gen;
-        std::uniform_int_distribution<> dis_w(1, std::min(1000000ll, n));
-        std::uniform_int_distribution<long long> dis_c(1, std::min((long long)1e12, n));
-        nthreads = omp_get_num_threads();
-        tid = omp_get_thread_num();
-        gen = std::mt19937(random_seed[tid]);
-        for(long long i = n*tid / nthreads; i< n*(tid+1)/ nthreads; ++i){
-            servers[i] = Server(dis_w(gen), dis_c(gen));
+    if (convert) {
+        bool ok = write_instance(positional[1], servers, n);
+        delete [] servers;
+        if (!ok) {
+            std::cout<< "Unable to write "<< positional[1] << endl;
+            return 1;
         }
+        return 0;
     }
 
     TIC(0);
@@ -0,0 +1,93 @@
+#pragma once
+
+// Counter-based generator mode. Server i is a pure function of (key, i):
+// Philox4x32-10 (Salmon et al., SC'11) encrypts the counter (i, 0, 0, 0)
+// under a key taken from the first two seeds of the seed file, and the four
+// output words give one 64-bit draw each for weight and capactiy. There is
+// no per-thread state, so the instance is the same for any thread count and
+// any split, and a thread can start anywhere without skipping ahead.
+//
+// The draws are uniform over the same ranges as the mt19937 generator, but
+// they are a different sequence, so answers differ from std_ans.
+
+#include "solver.hpp"
+#include <cstdint>
+#include "omp.h"
+
+const uint32_t PHILOX_M0 = 0xD2511F53u, PHILOX_M1 = 0xCD9E8D57u;
+const uint32_t PHILOX_W0 = 0x9E3779B9u, PHILOX_W1 = 0xBB67AE85u;
+// Counters encrypted per block; the lane loops below are written so the
+// compiler keeps the block in vector registers.
+const int PHILOX_LANES = 16;
+
+struct PhiloxKey {
+    uint32_t k0, k1;
+};
+
+inline PhiloxKey philox_key(const int *random_seed) { return {(uint32_t)random_seed[0], (uint32_t)random_seed[1]}; }
+
+// Philox4x32-10 on counters first, first + 1, ..., first + PHILOX_LANES - 1.
+inline void philox_block(uint64_t first, PhiloxKey key, uint32_t out[4][PHILOX_LANES]) {
+    uint32_t x0[PHILOX_LANES], x1[PHILOX_LANES], x2[PHILOX_LANES], x3[PHILOX_LANES];
+    for (int l = 0; l < PHILOX_LANES; ++l) {
+        x0[l] = (uint32_t)(first + l);
+        x1[l] = (uint32_t)((first + l) >> 32);
+        x2[l] = 0;
+        x3[l] = 0;
+    }
+    uint32_t k0 = key.k0, k1 = key.k1;
+    for (int r = 0; r < 10; ++r) {
+        #pragma omp simd
+        for (int l = 0; l < PHILOX_LANES; ++l) {
+            uint64_t p0 = (uint64_t)PHILOX_M0 * x0[l];
+            uint64_t p1 = (uint64_t)PHILOX_M1 * x2[l];
+            uint32_t y0 = (uint32_t)(p1 >> 32) ^ x1[l] ^ k0;
+            uint32_t y1 = (uint32_t)p1;
+            uint32_t y2 = (uint32_t)(p0 >> 32) ^ x3[l] ^ k1;
+            uint32_t y3 = (uint32_t)p0;
+            x0[l] = y0;
+            x1[l] = y1;
+            x2[l] = y2;
+            x3[l] = y3;
+        }
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    for (int l = 0; l < PHILOX_LANES; ++l) {
+        out[0][l] = x0[l];
+        out[1][l] = x1[l];
+        out[2][l] = x2[l];
+        out[3][l] = x3[l];
+    }
+}
+
+// Uniform in [1, range] from a 64-bit draw (multiply-shift; the bias is at
+// most range / 2^64).
+inline long long philox_uniform(uint32_t lo, uint32_t hi, long long range) {
+    uint64_t x = (uint64_t)hi << 32 | lo;
+    return 1 + (long long)(((unsigned __int128)x * (uint64_t)range) >> 64);
+}
+
+// Writes servers first .. first + count - 1 of the instance to out[0, count).
+inline void philox_servers(Server *out, long long first, long long count, PhiloxKey key,
+                           long long w_max, long long c_max) {
+    uint32_t r[4][PHILOX_LANES];
+    for (long long k = 0; k < count; k += PHILOX_LANES) {
+        philox_block(first + k, key, r);
+        int lanes = (int)std::min((long long)PHILOX_LANES, count - k);
+        for (int l = 0; l < lanes; ++l)
+            out[k + l] = Server(philox_uniform(r[0][l], r[1][l], w_max), philox_uniform(r[2][l], r[3][l], c_max));
+    }
+}
+
+// Counter-based counterpart of generate_servers, same value ranges.
+inline void generate_servers_philox(Server *servers, long long n, const int *random_seed) {
+    long long w_max = std::min(1000000ll, n), c_max = std::min((long long)1e12, n);
+    PhiloxKey key = philox_key(random_seed);
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+        long long begin = slice_begin(n, tid, nthreads);
+        philox_servers(servers + begin, begin, slice_begin(n, tid + 1, nthreads) - begin, key, w_max, c_max);
+    }
+}
@@ -1,12 +1,903 @@
 #pragma once
 
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include <sched.h>
+#include "omp.h"
+
 struct Server {
     long long weight, capactiy;
     Server(long long w, long long c) : weight(w), capactiy(c) {}
     Server(){}
 };
 
-long long solve(Server *servers, long long n){
-    // write you code here
-    return 0ll;
+// Exchange argument: for two adjacent servers the one with the smaller
+// weight + capactiy belongs on top. Servers sharing a key can go in any
+// order, so sorting by the key alone gives an optimal stack and the answer
+// is max_i (sum of weights above i - capactiy_i).
+
+inline long long server_key(const Server &s) { return s.weight + s.capactiy; }
+
+// Below this size the parallel passes cost more than they save.
+const long long SERIAL_CUTOFF = 1 << 16;
+
+// Thread tid of nthreads owns [slice_begin(tid), slice_begin(tid + 1)).
+// main.cpp generates the servers with the same split, so under
+// OMP_PROC_BIND every pass over servers reads pages its own thread wrote
+// first, i.e. memory on its own NUMA node. nthreads is always the team
+// actually delivered (omp_get_num_threads() inside the region), which can
+// be smaller than requested when nested, or under OMP_DYNAMIC or
+// OMP_THREAD_LIMIT; per-thread tables are sized from it in a single block.
+inline long long slice_begin(long long n, int tid, int nthreads) { return n * tid / nthreads; }
+
+// Number of NUMA nodes the OpenMP team runs on, from sysfs cpulists.
+inline int numa_nodes_spanned() {
+    std::vector<int> node_of_cpu;
+    int nodes = 0;
+    for (;; ++nodes) {
+        char path[64];
+        std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes);
+        FILE *f = std::fopen(path, "r");
+        if (!f) break;
+        int lo, hi;
+        while (std::fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            int c = std::fgetc(f);
+            if (c == '-') {
+                if (std::fscanf(f, "%d", &hi) != 1) break;
+                c = std::fgetc(f);
+            }
+            if (hi >= (int)node_of_cpu.size()) node_of_cpu.resize(hi + 1, -1);
+            for (int cpu = lo; cpu <= hi; ++cpu) node_of_cpu[cpu] = nodes;
+            if (c != ',') break;
+        }
+        std::fclose(f);
+    }
+    if (nodes <= 1) return 1;
+    std::vector<int> used(nodes, 0);
+    #pragma omp parallel
+    {
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < (int)node_of_cpu.size() && node_of_cpu[cpu] >= 0) {
+            #pragma omp atomic write
+            used[node_of_cpu[cpu]] = 1;
+        }
+    }
+    return std::max(1, (int)std::count(used.begin(), used.end(), 1));
+}
+
+// Whether the solver keeps its scatter phases node-local (see
+// count_bucketed). SOLVER_NUMA=1/0 forces it; by default it is on when the
+// team spans more than one NUMA node.
+inline bool numa_local() {
+    if (const char *env = std::getenv("SOLVER_NUMA")) return std::atoi(env) != 0;
+    return numa_nodes_spanned() > 1;
+}
+
+// Optional per-phase timing of one solve, in seconds, for the benchmark
+// mode: key projection (key range scan, packing), binning (histogram or
+// sort), the prefix scan, and the final reduction across threads.
+struct SolveProfile {
+    const char *path;
+    double project, bin, scan, reduce;
+};
+
+// Adds the time since *t to the given phase and restarts *t.
+inline void profile_mark(SolveProfile *profile, double SolveProfile::*phase, double *t) {
+    if (!profile) return;
+    double now = omp_get_wtime();
+    profile->*phase += now - *t;
+    *t = now;
+}
+
+const int RADIX_BITS = 11;
+const int RADIX = 1 << RADIX_BITS;
+
+struct KeyStats {
+    long long min_key, max_key, min_weight, max_weight;
+    long long range() const { return max_key - min_key + 1; }
+};
+
+inline KeyStats key_stats(const Server *servers, long long n) {
+    long long min_key = LLONG_MAX, max_key = LLONG_MIN, min_weight = LLONG_MAX, max_weight = LLONG_MIN;
+    #pragma omp parallel reduction(min : min_key, min_weight) reduction(max : max_key, max_weight)
+    {
+        int tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+        long long end = slice_begin(n, tid + 1, nthreads);
+        for (long long i = slice_begin(n, tid, nthreads); i < end; ++i) {
+            long long k = server_key(servers[i]);
+            min_key = std::min(min_key, k);
+            max_key = std::max(max_key, k);
+            min_weight = std::min(min_weight, servers[i].weight);
+            max_weight = std::max(max_weight, servers[i].weight);
+        }
+    }
+    return {min_key, max_key, min_weight, max_weight};
+}
+
+inline int bit_length(unsigned long long x) {
+    int b = 0;
+    while (x) {
+        ++b;
+        x >>= 1;
+    }
+    return b;
+}
+
+// Compact form: one 64-bit word per server, (key - min_key) in the high half
+// and the weight in the low half; capactiy is recovered as key - weight.
+// Half the bytes of a Server, and a plain integer compare orders by key.
+// The problem bounds (w < 1e6, key < 2n) always fit for n < 2^31.
+typedef uint64_t PackedServer;
+
+inline bool packable(const KeyStats &st) {
+    return st.range() <= (1ll << 32) && st.min_weight >= 0 && st.max_weight < (1ll << 32);
+}
+
+inline PackedServer pack_server(const Server &s, long long min_key) {
+    return (uint64_t)(server_key(s) - min_key) << 32 | (uint64_t)s.weight;
+}
+
+inline long long packed_weight(PackedServer p) { return (long long)(p & 0xffffffffu); }
+inline long long packed_capactiy(PackedServer p, long long min_key) {
+    return (long long)(p >> 32) + min_key - packed_weight(p);
+}
+
+// Stable LSD radix sort on digit_source(x), which must be < 2^key_bits.
+// Each pass: per-thread digit histograms over a static block, global
+// offsets in (digit, thread) order, scatter. Returns whichever of src/tmp
+// holds the sorted result.
+template <typename T, typename DigitSource>
+T *radix_sort(T *src, T *tmp, long long n, int key_bits, DigitSource digit_source) {
+    std::vector<long long> hist;
+    T *dst = tmp;
+
+    for (int shift = 0; shift < key_bits; shift += RADIX_BITS) {
+        int nthreads = 1;
+        #pragma omp parallel
+        {
+            #pragma omp single
+            {
+                nthreads = omp_get_num_threads();
+                hist.resize((size_t)nthreads * RADIX);
+            }
+            int tid = omp_get_thread_num();
+            long long begin = slice_begin(n, tid, nthreads), end = slice_begin(n, tid + 1, nthreads);
+            long long *h = &hist[(size_t)tid * RADIX];
+            std::fill(h, h + RADIX, 0);
+            for (long long i = begin; i < end; ++i)
+                ++h[(digit_source(src[i]) >> shift) & (RADIX - 1)];
+            #pragma omp barrier
+            #pragma omp single
+            {
+                long long offset = 0;
+                for (int d = 0; d < RADIX; ++d) {
+                    for (int t = 0; t < nthreads; ++t) {
+                        long long c = hist[(size_t)t * RADIX + d];
+                        hist[(size_t)t * RADIX + d] = offset;
+                        offset += c;
+                    }
+                }
+            }
+            for (long long i = begin; i < end; ++i)
+                dst[h[(digit_source(src[i]) >> shift) & (RADIX - 1)]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+    return src;
+}
+
+// max_i (prefix weight before i - capactiy_i) over a sequence in stack
+// order, as a parallel two-pass scan: block sums, then per-block maxima.
+template <typename T, typename Weight, typename Capactiy>
+long long max_risk_in_order(const T *order, long long n, Weight weight, Capactiy capactiy,
+                            SolveProfile *profile = nullptr) {
+    double t = omp_get_wtime();
+    int nthreads = 1;
+    std::vector<long long> block_sum, block_max;
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            nthreads = omp_get_num_threads();
+            block_sum.assign(nthreads + 1, 0);
+            block_max.assign(nthreads, LLONG_MIN);
+        }
+        int tid = omp_get_thread_num();
+        long long begin = slice_begin(n, tid, nthreads), end = slice_begin(n, tid + 1, nthreads);
+        long long sum = 0;
+        for (long long i = begin; i < end; ++i)
+            sum += weight(order[i]);
+        block_sum[tid + 1] = sum;
+        #pragma omp barrier
+        #pragma omp single
+        for (int t = 0; t < nthreads; ++t)
+            block_sum[t + 1] += block_sum[t];
+        long long prefix = block_sum[tid], best = LLONG_MIN;
+        for (long long i = begin; i < end; ++i) {
+            best = std::max(best, prefix - capactiy(order[i]));
+            prefix += weight(order[i]);
+        }
+        block_max[tid] = best;
+    }
+    profile_mark(profile, &SolveProfile::scan, &t);
+    long long best = *std::max_element(block_max.begin(), block_max.end());
+    profile_mark(profile, &SolveProfile::reduce, &t);
+    return best;
+}
+
+inline long long solve_serial(const Server *servers, long long n, SolveProfile *profile = nullptr) {
+    double t = omp_get_wtime();
+    if (profile) profile->path = "serial";
+    std::vector<Server> order(servers, servers + n);
+    std::sort(order.begin(), order.end(),
+              [](const Server &a, const Server &b) { return server_key(a) < server_key(b); });
+    profile_mark(profile, &SolveProfile::bin, &t);
+    long long prefix = 0, best = LLONG_MIN;
+    for (const Server &s : order) {
+        best = std::max(best, prefix - s.capactiy);
+        prefix += s.weight;
+    }
+    profile_mark(profile, &SolveProfile::scan, &t);
+    return best;
+}
+
+// Parallel radix sort on the key followed by a parallel scan. When the
+// servers pack into 64-bit words only that compact stream is sorted (two
+// n * 8 byte arrays, servers untouched); otherwise the structs themselves
+// are sorted with one n-sized scratch array and servers is permuted.
+// stats, when given, are the key_stats of servers already computed.
+inline long long solve_sort(Server *servers, long long n, SolveProfile *profile = nullptr,
+                            const KeyStats *stats = nullptr) {
+    if (n < SERIAL_CUTOFF) return solve_serial(servers, n, profile);
+
+    double t = omp_get_wtime();
+    if (profile) profile->path = "sort";
+    KeyStats st = stats ? *stats : key_stats(servers, n);
+    int key_bits = bit_length(st.max_key - st.min_key);
+    long long min_key = st.min_key;
+
+    if (packable(st)) {
+        PackedServer *a = new PackedServer[n];
+        PackedServer *b = new PackedServer[n];
+        #pragma omp parallel
+        {
+            int tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+            long long end = slice_begin(n, tid + 1, nthreads);
+            for (long long i = slice_begin(n, tid, nthreads); i < end; ++i)
+                a[i] = pack_server(servers[i], min_key);
+        }
+        profile_mark(profile, &SolveProfile::project, &t);
+        PackedServer *sorted = radix_sort(a, b, n, key_bits,
+                                          [](PackedServer p) { return p >> 32; });
+        profile_mark(profile, &SolveProfile::bin, &t);
+        long long ans = max_risk_in_order(sorted, n, packed_weight,
+                                          [min_key](PackedServer p) { return packed_capactiy(p, min_key); }, profile);
+        delete [] a;
+        delete [] b;
+        return ans;
+    }
+
+    profile_mark(profile, &SolveProfile::project, &t);
+    Server *tmp = new Server[n];
+    Server *sorted = radix_sort(servers, tmp, n, key_bits,
+                                [min_key](const Server &s) { return (uint64_t)(server_key(s) - min_key); });
+    profile_mark(profile, &SolveProfile::bin, &t);
+    long long ans = max_risk_in_order(sorted, n, [](const Server &s) { return s.weight; },
+                                      [](const Server &s) { return s.capactiy; }, profile);
+    delete [] tmp;
+    return ans;
+}
+
+// Counting path. Within one key bucket s every order is optimal and the
+// bucket's worst server has risk (weight of the bucket and everything above
+// it) - s, independent of the individual capacities. So the answer is
+// max over non-empty s of (W[<= s] - s), where W[s] sums the weights with
+// key s: an O(n + range) histogram plus a scan, with no sort.
+
+// Per-thread private histograms are used while they fit in this many bytes
+// in total; beyond that the servers are bucketed by key first.
+const long long COUNTING_PRIVATE_BYTES = 256ll << 20;
+// The bucketed path splits the key range into at most 2^COUNTING_BUCKET_BITS
+// buckets of equal power-of-two width, range >> COUNTING_BUCKET_BITS keys
+// rounded up. Its per-thread count/offset/weight tables (24 bytes per
+// bucket per thread) are held to COUNTING_TABLE_BYTES in total by using
+// fewer, wider buckets on large teams.
+const int COUNTING_BUCKET_BITS = 16;
+const long long COUNTING_TABLE_BYTES = 64ll << 20;
+// Wider key ranges than this many keys per server take the sort path.
+const long long COUNTING_KEYS_PER_SERVER = 4;
+
+// max over non-empty s in [0, range) of (prefix sum of hist through s) - (s + key_base).
+// A key is non-empty when its bit in present is set, or, without a bitmap,
+// when hist[s] > 0 (all weights positive).
+inline long long max_risk_from_histogram(const long long *hist, long long range, long long key_base,
+                                         const uint64_t *present = nullptr, SolveProfile *profile = nullptr) {
+    double t = omp_get_wtime();
+    int nthreads = 1;
+    std::vector<long long> block_sum, block_max;
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            nthreads = omp_get_num_threads();
+            block_sum.assign(nthreads + 1, 0);
+            block_max.assign(nthreads, LLONG_MIN);
+        }
+        int tid = omp_get_thread_num();
+        long long begin = slice_begin(range, tid, nthreads), end = slice_begin(range, tid + 1, nthreads);
+        long long sum = 0;
+        for (long long s = begin; s < end; ++s)
+            sum += hist[s];
+        block_sum[tid + 1] = sum;
+        #pragma omp barrier
+        #pragma omp single
+        for (int t = 0; t < nthreads; ++t)
+            block_sum[t + 1] += block_sum[t];
+        long long prefix = block_sum[tid], best = LLONG_MIN;
+        for (long long s = begin; s < end; ++s) {
+            prefix += hist[s];
+            if (present ? (present[s >> 6] >> (s & 63)) & 1 : hist[s] > 0)
+                best = std::max(best, prefix - (s + key_base));
+        }
+        block_max[tid] = best;
+    }
+    profile_mark(profile, &SolveProfile::scan, &t);
+    long long best = *std::max_element(block_max.begin(), block_max.end());
+    profile_mark(profile, &SolveProfile::reduce, &t);
+    return best;
+}
+
+inline long long count_private(const Server *servers, long long n, const KeyStats &st,
+                               SolveProfile *profile = nullptr) {
+    double t = omp_get_wtime();
+    if (profile) profile->path = "private";
+    int nthreads = 1;
+    long long range = st.range(), min_key = st.min_key;
+    std::vector<long long> local, hist(range);
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            nthreads = omp_get_num_threads();
+            local.resize((size_t)range * nthreads);
+        }
+        int tid = omp_get_thread_num();
+        long long *h = &local[(size_t)range * tid];
+        long long end = slice_begin(n, tid + 1, nthreads);
+        for (long long i = slice_begin(n, tid, nthreads); i < end; ++i)
+            h[server_key(servers[i]) - min_key] += servers[i].weight;
+        #pragma omp barrier
+        #pragma omp for schedule(static)
+        for (long long s = 0; s < range; ++s) {
+            long long sum = 0;
+            for (int t = 0; t < nthreads; ++t)
+                sum += local[(size_t)range * t + s];
+            hist[s] = sum;
+        }
+    }
+    profile_mark(profile, &SolveProfile::bin, &t);
+    return max_risk_from_histogram(hist.data(), range, min_key, nullptr, profile);
+}
+
+// Wide key ranges: one pass scatters the compact words into at most
+// 2^COUNTING_BUCKET_BITS key buckets (an MSD radix pass on the top bits of
+// the key offset), recording each bucket's weight total on the way. Each
+// bucket is then counted in a histogram of its width and scanned from its
+// own starting prefix.
+//
+// With node_local set, each thread scatters only within its own slice of
+// the buffer (pages it first-touches itself), so the scatter never writes
+// to a remote node; per-thread bucket counts are the only shared state.
+// Counting a bucket then streams its pieces from every slice. Otherwise
+// buckets are laid out contiguously and threads scatter into all of them.
+inline long long count_bucketed(const Server *servers, long long n, const KeyStats &st, bool node_local,
+                                SolveProfile *profile = nullptr) {
+    double t = omp_get_wtime();
+    if (profile) profile->path = "bucketed";
+    int nthreads = 1;
+    long long range = st.range(), min_key = st.min_key;
+    // the delivered team is at most omp_get_max_threads(), so this bounds it
+    int bucket_bits = COUNTING_BUCKET_BITS;
+    while (bucket_bits > 0 &&
+           3 * sizeof(long long) * omp_get_max_threads() * (1ull << bucket_bits) > (uint64_t)COUNTING_TABLE_BYTES)
+        --bucket_bits;
+    int shift = std::max(0, bit_length(range - 1) - bucket_bits);
+    long long nbuckets = ((range - 1) >> shift) + 1;
+    long long bucket_keys = 1ll << shift;
+
+    std::vector<long long> count, offset, wsum, bucket_base(nbuckets), best_of;
+    PackedServer *buf = new PackedServer[n];
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            nthreads = omp_get_num_threads();
+            count.resize((size_t)nthreads * nbuckets);
+            offset.resize((size_t)nthreads * nbuckets);
+            wsum.resize((size_t)nthreads * nbuckets);
+            best_of.assign(nthreads, LLONG_MIN);
+        }
+        int tid = omp_get_thread_num();
+        long long begin = slice_begin(n, tid, nthreads), end = slice_begin(n, tid + 1, nthreads);
+        long long *cnt = &count[(size_t)tid * nbuckets];
+        long long *off = &offset[(size_t)tid * nbuckets];
+        long long *ws = &wsum[(size_t)tid * nbuckets];
+        for (long long i = begin; i < end; ++i) {
+            long long b = (server_key(servers[i]) - min_key) >> shift;
+            ++cnt[b];
+            ws[b] += servers[i].weight;
+        }
+        if (node_local) {
+            long long pos = begin;
+            for (long long b = 0; b < nbuckets; ++b) {
+                off[b] = pos;
+                pos += cnt[b];
+            }
+        }
+        #pragma omp barrier
+        #pragma omp single
+        {
+            long long pos = 0, weight = 0;
+            for (long long b = 0; b < nbuckets; ++b) {
+                bucket_base[b] = weight;
+                for (int t = 0; t < nthreads; ++t) {
+                    if (!node_local) {
+                        offset[(size_t)t * nbuckets + b] = pos;
+                        pos += count[(size_t)t * nbuckets + b];
+                    }
+                    weight += wsum[(size_t)t * nbuckets + b];
+                }
+            }
+        }
+        for (long long i = begin; i < end; ++i) {
+            PackedServer p = pack_server(servers[i], min_key);
+            buf[off[(p >> 32) >> shift]++] = p;
+        }
+        #pragma omp barrier
+        #pragma omp master
+        profile_mark(profile, &SolveProfile::bin, &t);
+
+        // offset[t][b] now points one past the piece thread t wrote for b
+        std::vector<long long> h(bucket_keys);
+        long long best = LLONG_MIN;
+        #pragma omp for schedule(dynamic, 16)
+        for (long long b = 0; b < nbuckets; ++b) {
+            std::fill(h.begin(), h.end(), 0);
+            long long lo = b << shift;
+            for (int t = 0; t < nthreads; ++t) {
+                long long piece_end = offset[(size_t)t * nbuckets + b];
+                for (long long i = piece_end - count[(size_t)t * nbuckets + b]; i < piece_end; ++i)
+                    h[(long long)(buf[i] >> 32) - lo] += packed_weight(buf[i]);
+            }
+            long long prefix = bucket_base[b];
+            long long keys = std::min(bucket_keys, range - lo);
+            for (long long s = 0; s < keys; ++s) {
+                prefix += h[s];
+                if (h[s] > 0)
+                    best = std::max(best, prefix - (min_key + lo + s));
+            }
+        }
+        best_of[tid] = best;
+    }
+    // per-bucket counting and scanning are fused; both count as scan
+    profile_mark(profile, &SolveProfile::scan, &t);
+    long long best = *std::max_element(best_of.begin(), best_of.end());
+    profile_mark(profile, &SolveProfile::reduce, &t);
+    delete [] buf;
+    return best;
+}
+
+// Falls back to solve_sort when a weight is not positive (an empty bucket
+// would be indistinguishable from one of zero weight), the key range is
+// over budget, or a wide range does not pack into 64-bit words.
+inline long long solve_counting(Server *servers, long long n, SolveProfile *profile = nullptr) {
+    if (n < SERIAL_CUTOFF) return solve_serial(servers, n, profile);
+
+    double t = omp_get_wtime();
+    KeyStats st = key_stats(servers, n);
+    profile_mark(profile, &SolveProfile::project, &t);
+    long long range = st.range();
+    if (st.min_weight <= 0 || range > COUNTING_KEYS_PER_SERVER * n) return solve_sort(servers, n, profile, &st);
+
+    if ((double)range * omp_get_max_threads() * sizeof(long long) <= COUNTING_PRIVATE_BYTES)
+        return count_private(servers, n, st, profile);
+    if (packable(st))
+        return count_bucketed(servers, n, st, numa_local(), profile);
+    return solve_sort(servers, n, profile, &st);
+}
+
+// Streaming solver: the same per-key histogram as the counting path, fed in
+// chunks, so memory is O(key range) no matter how many servers stream
+// through and the answer is exact after one pass. A bitmap marks the keys
+// seen, so zero weights need no special casing.
+class StreamingSolver {
+public:
+    // An empty solver allocates nothing; the first add() anchors the
+    // histogram at that chunk's key window.
+    StreamingSolver() : key_base(0), range(0), hist(nullptr), present(nullptr) {}
+    // [min_key, max_key] sizes the initial histogram. add() grows it when a
+    // chunk falls outside; add_concurrent() needs every key to be in range.
+    StreamingSolver(long long min_key, long long max_key) : StreamingSolver() {
+        resize(min_key, std::max(min_key, max_key));
+    }
+    ~StreamingSolver() {
+        delete [] hist;
+        delete [] present;
+    }
+    StreamingSolver(const StreamingSolver &) = delete;
+    StreamingSolver &operator=(const StreamingSolver &) = delete;
+
+    bool covers(long long key) const { return key >= key_base && key - key_base < range; }
+
+    // Parallel over the chunk; call from serial code.
+    void add(const Server *chunk, long long count) {
+        if (count <= 0) return;
+        long long lo = LLONG_MAX, hi = LLONG_MIN;
+        #pragma omp parallel for reduction(min : lo) reduction(max : hi)
+        for (long long i = 0; i < count; ++i) {
+            lo = std::min(lo, server_key(chunk[i]));
+            hi = std::max(hi, server_key(chunk[i]));
+        }
+        if (range == 0) {
+            resize(lo, hi);
+        } else if (!covers(lo) || !covers(hi)) {
+            // grow the window on the side that overflowed by at least its
+            // span, so a slowly widening key range costs O(log) copies
+            long long max_key = key_base + range - 1;
+            resize(lo < key_base ? std::min(lo, key_base - range) : key_base,
+                   hi > max_key ? std::max(hi, max_key + range) : max_key);
+        }
+        #pragma omp parallel
+        add_concurrent_range(chunk, count);
+    }
+
+    // Thread-safe add for callers already inside a parallel region, e.g. one
+    // chunk per thread. Every key must satisfy covers(); returns false (and
+    // adds nothing) otherwise.
+    bool add_concurrent(const Server *chunk, long long count) {
+        for (long long i = 0; i < count; ++i)
+            if (!covers(server_key(chunk[i]))) return false;
+        add_unchecked(chunk, 0, count);
+        return true;
+    }
+
+    // Minimum max-risk of every server added so far (0 if none).
+    long long answer() const {
+        long long best = max_risk_from_histogram(hist, range, key_base, present);
+        return best == LLONG_MIN ? 0 : best;
+    }
+
+private:
+    long long key_base, range;
+    long long *hist;
+    uint64_t *present;
+
+    void add_concurrent_range(const Server *chunk, long long count) {
+        int tid = omp_get_thread_num(), nthreads = omp_get_num_threads();
+        add_unchecked(chunk, slice_begin(count, tid, nthreads), slice_begin(count, tid + 1, nthreads));
+    }
+
+    void add_unchecked(const Server *chunk, long long begin, long long end) {
+        for (long long i = begin; i < end; ++i) {
+            long long s = server_key(chunk[i]) - key_base;
+            long long *slot = &hist[s];
+            uint64_t *word = &present[s >> 6];
+            uint64_t bit = 1ull << (s & 63);
+            uint64_t seen;
+            #pragma omp atomic
+            *slot += chunk[i].weight;
+            #pragma omp atomic read
+            seen = *word;
+            if (!(seen & bit)) {
+                #pragma omp atomic
+                *word |= bit;
+            }
+        }
+    }
+
+    void resize(long long min_key, long long max_key) {
+        long long new_range = max_key - min_key + 1, shift = key_base - min_key;
+        long long *new_hist = new long long[new_range];
+        uint64_t *new_present = new uint64_t[(new_range + 63) / 64];
+        #pragma omp parallel for schedule(static)
+        for (long long s = 0; s < new_range; ++s)
+            new_hist[s] = 0;
+        #pragma omp parallel for schedule(static)
+        for (long long w = 0; w < (new_range + 63) / 64; ++w)
+            new_present[w] = 0;
+        #pragma omp parallel for schedule(static)
+        for (long long s = 0; s < range; ++s) {
+            new_hist[s + shift] = hist[s];
+            if ((present[s >> 6] >> (s & 63)) & 1) {
+                #pragma omp atomic
+                new_present[(s + shift) >> 6] |= 1ull << ((s + shift) & 63);
+            }
+        }
+        delete [] hist;
+        delete [] present;
+        hist = new_hist;
+        present = new_present;
+        key_base = min_key;
+        range = new_range;
+    }
+};
+
+// Streams any input iterator of Servers through a StreamingSolver in
+// fixed-size chunks; only one chunk is resident at a time.
+template <typename InputIt>
+long long solve_stream(InputIt first, InputIt last, long long chunk_size = 1 << 22) {
+    StreamingSolver solver;
+    std::vector<Server> chunk;
+    chunk.reserve(chunk_size);
+    while (first != last) {
+        chunk.clear();
+        for (; first != last && (long long)chunk.size() < chunk_size; ++first)
+            chunk.push_back(*first);
+        solver.add(chunk.data(), chunk.size());
+    }
+    return solver.answer();
+}
+
+// Batched queries over several fleets (racks). Fleet f is
+// servers[offsets[f], offsets[f + 1]). All fleets share one radix sort of
+// server indices on (fleet, key), so a batch of many small racks costs one
+// sort rather than one per rack, and only indices move, never Servers.
+// Index must hold offsets[nfleets] and Value (signed) every fleet's weight
+// sum and keys; 32-bit types halve the sort traffic for small racks.
+//
+// answers[f] gets fleet f's minimum max-risk (0 if empty). If order is
+// given, order[offsets[f] + k] is the index of the k-th server from the
+// top of fleet f in an optimal stack; if risk is given, risk[i] is server
+// i's risk in that stack.
+template <typename Index, typename Value>
+Value scan_fleet(const Server *servers, const Index *order, long long len, Value *risk) {
+    Value prefix = 0, best = std::numeric_limits<Value>::min();
+    for (long long k = 0; k < len; ++k) {
+        const Server &s = servers[order[k]];
+        Value r = prefix - (Value)s.capactiy;
+        if (risk) risk[order[k]] = r;
+        best = std::max(best, r);
+        prefix += (Value)s.weight;
+    }
+    return len > 0 ? best : 0;
+}
+
+template <typename Index, typename Value>
+void solve_fleets(const Server *servers, const Index *offsets, Index nfleets, Value *answers,
+                  Index *order = nullptr, Value *risk = nullptr) {
+    static_assert(std::is_integral<Index>::value, "Index must be an integer type");
+    static_assert(std::is_integral<Value>::value && std::is_signed<Value>::value, "Value must be a signed integer type");
+    if (nfleets <= 0) return;
+    long long n = offsets[nfleets];
+    Index *idx = order ? order : new Index[n];
+    std::vector<Index> tmp(n), fleet_of(n);
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (long long f = 0; f < (long long)nfleets; ++f) {
+        for (long long i = offsets[f]; i < (long long)offsets[f + 1]; ++i) {
+            fleet_of[i] = (Index)f;
+            idx[i] = (Index)i;
+        }
+    }
+
+    KeyStats st = n > 0 ? key_stats(servers, n) : KeyStats{0, 0, 0, 0};
+    long long min_key = st.min_key;
+    int key_bits = bit_length(st.max_key - st.min_key), fleet_bits = bit_length(nfleets - 1);
+    if (key_bits + fleet_bits < 64) {
+        const Index *fleet = fleet_of.data();
+        Index *sorted = radix_sort(idx, tmp.data(), n, key_bits + fleet_bits, [=](Index i) {
+            return (uint64_t)fleet[i] << key_bits | (uint64_t)(server_key(servers[i]) - min_key);
+        });
+        if (sorted != idx) {
+            #pragma omp parallel for schedule(static)
+            for (long long i = 0; i < n; ++i)
+                idx[i] = sorted[i];
+        }
+    } else {
+        // keys too wide to share one sort word with the fleet id
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (long long f = 0; f < (long long)nfleets; ++f)
+            std::stable_sort(idx + offsets[f], idx + offsets[f + 1], [servers](Index a, Index b) {
+                return server_key(servers[a]) < server_key(servers[b]);
+            });
+    }
+
+    // Large fleets get the parallel scan when no risk profile is wanted;
+    // the rest are scanned one fleet per thread.
+    auto large = [&](long long f) { return !risk && offsets[f + 1] - offsets[f] >= SERIAL_CUTOFF; };
+    for (long long f = 0; f < (long long)nfleets; ++f) {
+        if (large(f))
+            answers[f] = (Value)max_risk_in_order(idx + offsets[f], offsets[f + 1] - offsets[f],
+                                                  [servers](Index i) { return servers[i].weight; },
+                                                  [servers](Index i) { return servers[i].capactiy; });
+    }
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (long long f = 0; f < (long long)nfleets; ++f) {
+        if (!large(f))
+            answers[f] = scan_fleet<Index, Value>(servers, idx + offsets[f], offsets[f + 1] - offsets[f], risk);
+    }
+    if (!order) delete [] idx;
+}
+
+// Single-fleet form: the answer plus, optionally, an optimal order and the
+// per-server risks.
+template <typename Index = long long, typename Value = long long>
+Value solve_order(const Server *servers, Index n, Index *order = nullptr, Value *risk = nullptr) {
+    Index offsets[2] = {0, n};
+    Value ans = 0;
+    solve_fleets<Index, Value>(servers, offsets, (Index)1, &ans, order, risk);
+    return ans;
+}
+
+// Incremental solver for a fleet that changes a few servers at a time. A
+// segment tree over the keys [min_key, max_key] keeps, per node, the weight
+// in its key range and the worst (prefix weight through s) - s over its
+// non-empty keys s, the prefix taken from the node's first key. A parent
+// combines its children as max(left.best, left.sum + right.best), so the
+// root holds the counting path's answer: queries are O(1) and a single
+// insert or erase updates O(log range) nodes. Memory is about 40 bytes per
+// key of the (power of two rounded) range.
+class IncrementalSolver {
+public:
+    IncrementalSolver(long long min_key, long long max_key) : key_base(min_key), leaves(1), servers(0) {
+        long long range = std::max(1ll, max_key - min_key + 1);
+        while (leaves < range) leaves <<= 1;
+        sum.assign(2 * leaves, 0);
+        best.assign(2 * leaves, NONE);
+        count.assign(leaves, 0);
+    }
+
+    bool covers(long long key) const { return key >= key_base && key - key_base < leaves; }
+
+    bool insert(const Server &s) { return update(s, 1); }
+
+    // s must have been inserted before; only its key and weight are used.
+    // Returns false if no server with that key is present.
+    bool erase(const Server &s) { return update(s, -1); }
+
+    // Batched updates: leaves are updated in parallel, then only the nodes
+    // above a changed leaf are recomputed, one tree level at a time (or the
+    // whole tree when most of it changed). Returns false, changing nothing,
+    // if a key is out of range; erase also needs every server present.
+    bool insert(const Server *batch, long long n) { return update(batch, n, 1); }
+    bool erase(const Server *batch, long long n) { return update(batch, n, -1); }
+
+    long long size() const { return servers; }
+
+    // Minimum max-risk of the current fleet (0 if empty).
+    long long answer() const { return best[1] == NONE ? 0 : best[1]; }
+
+private:
+    static constexpr long long NONE = LLONG_MIN;
+    // Batches smaller than this are applied one server at a time.
+    static constexpr long long BATCH_CUTOFF = 1 << 12;
+
+    long long key_base, leaves, servers;
+    std::vector<long long> sum, best, count;
+
+    void refresh_leaf(long long s) {
+        long long v = leaves + s;
+        best[v] = count[s] > 0 ? sum[v] - (key_base + s) : NONE;
+    }
+
+    void pull(long long v) {
+        sum[v] = sum[2 * v] + sum[2 * v + 1];
+        best[v] = best[2 * v + 1] == NONE ? best[2 * v] : std::max(best[2 * v], sum[2 * v] + best[2 * v + 1]);
+    }
+
+    bool update(const Server &srv, int sign) {
+        long long key = server_key(srv);
+        if (!covers(key)) return false;
+        long long s = key - key_base;
+        if (sign < 0 && count[s] == 0) return false;
+        sum[leaves + s] += sign * srv.weight;
+        count[s] += sign;
+        servers += sign;
+        refresh_leaf(s);
+        for (long long v = (leaves + s) >> 1; v >= 1; v >>= 1)
+            pull(v);
+        return true;
+    }
+
+    bool update(const Server *batch, long long n, int sign) {
+        if (n <= 0) return true;
+        bool ok = true;
+        #pragma omp parallel for reduction(&& : ok)
+        for (long long i = 0; i < n; ++i)
+            ok = ok && covers(server_key(batch[i]));
+        if (!ok) return false;
+
+        if (n < BATCH_CUTOFF) {
+            if (sign < 0 && !all_present(batch, n)) return false;
+            for (long long i = 0; i < n; ++i)
+                update(batch[i], sign);
+            return true;
+        }
+
+        std::vector<uint64_t> dirty(n), tmp(n);
+        #pragma omp parallel for
+        for (long long i = 0; i < n; ++i) {
+            long long s = server_key(batch[i]) - key_base;
+            long long *w = &sum[leaves + s], *c = &count[s];
+            #pragma omp atomic
+            *w += sign * batch[i].weight;
+            #pragma omp atomic
+            *c += sign;
+            dirty[i] = s;
+        }
+
+        uint64_t *changed = radix_sort(dirty.data(), tmp.data(), n, bit_length(leaves - 1),
+                                       [](uint64_t s) { return s; });
+        long long k = std::unique(changed, changed + n) - changed;
+        if (sign < 0) {
+            // erase checks presence on the updated leaf counts; a negative
+            // count means the batch removed more than was there, so undo it
+            bool present = true;
+            #pragma omp parallel for reduction(&& : present)
+            for (long long j = 0; j < k; ++j)
+                present = present && count[changed[j]] >= 0;
+            if (!present) {
+                #pragma omp parallel for
+                for (long long i = 0; i < n; ++i) {
+                    long long s = server_key(batch[i]) - key_base;
+                    long long *w = &sum[leaves + s], *c = &count[s];
+                    #pragma omp atomic
+                    *w -= sign * batch[i].weight;
+                    #pragma omp atomic
+                    *c -= sign;
+                }
+                return false;
+            }
+        }
+        servers += sign * n;
+        #pragma omp parallel for
+        for (long long j = 0; j < k; ++j)
+            refresh_leaf(changed[j]);
+
+        for (long long level = leaves >> 1; level >= 1; level >>= 1) {
+            if (k >= level / 8) {
+                // most of this level is dirty: recompute it and everything above
+                for (; level >= 1; level >>= 1) {
+                    #pragma omp parallel for
+                    for (long long v = level; v < 2 * level; ++v)
+                        pull(v);
+                }
+                break;
+            }
+            // changed[] is sorted, so the parents are too
+            for (long long j = 0; j < k; ++j)
+                changed[j] >>= 1;
+            k = std::unique(changed, changed + k) - changed;
+            #pragma omp parallel for
+            for (long long j = 0; j < k; ++j)
+                pull(level + changed[j]);
+        }
+        return true;
+    }
+
+    // Every key of the batch has at least as many servers as the batch removes.
+    // Only used below BATCH_CUTOFF; larger batches check the leaf counts.
+    bool all_present(const Server *batch, long long n) const {
+        std::vector<long long> keys(n);
+        for (long long i = 0; i < n; ++i)
+            keys[i] = server_key(batch[i]) - key_base;
+        std::sort(keys.begin(), keys.end());
+        for (long long i = 0, j; i < n; i = j) {
+            for (j = i; j < n && keys[j] == keys[i]; ++j) {}
+            if (count[keys[i]] < j - i) return false;
+        }
+        return true;
+    }
+};
+
+long long solve(Server *servers, long long n, SolveProfile *profile = nullptr){
+    if (n <= 0) return 0;
+    return solve_counting(servers, n, profile);
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+#!/bin/sh
+# 在 ref_data 的全部算例上比较 mixed（混合精度）与 direct（双精度）模式，
+# 每个算例输出：mixed 模式通过校验的次数、每步作用力相对双精度参照的最大偏差、
+# 以及最后一次输出的动量与能量与 direct 模式之差。最后给出全部算例中的最大偏差。
+#
+# 用法：./check_mixed.sh [可执行文件]      默认为 ./nbody_simulator_omp
+#       ./check_mixed.sh ./nbody_simulator_omp ref_data/1024_*.ref   只检查部分算例
+
+BIN=${1:-./nbody_simulator_omp}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- ref_data/*.ref
+
+if [ ! -x "$BIN" ]; then
+    echo "executable not found: $BIN (build it with: make omp)"
+    exit 1
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# 最后一次输出的动量三个分量与能量
+last_values() {
+    awk '/Current Momentum/ { gsub(/[(),]/, " "); px = $3; py = $4; pz = $5 }
+         /Current Energy/ { e = $3 }
+         END { print px, py, pz, e }' "$1"
+}
+
+printf "%-12s %8s %14s %14s %14s\n" case passed max_force_dev momentum_diff energy_diff
+worst=0
+status=0
+for ref in "$@"; do
+    name=$(basename "$ref" .ref)
+    NBODY_FORCE=direct "$BIN" "$ref" > "$TMP/direct.txt"
+    NBODY_FORCE=mixed NBODY_MIXED_CHECK=1 "$BIN" "$ref" > "$TMP/mixed.txt" 2> "$TMP/check.txt"
+    passed=$(grep -c "Validation Passed" "$TMP/mixed.txt")
+    total=$(grep -c "Validation" "$TMP/mixed.txt")
+    grep -q "Validation Fail" "$TMP/mixed.txt" && status=1
+    dev=$(sed -n 's/.*max relative force deviation \([^ ]*\).*/\1/p' "$TMP/check.txt")
+    set -- $(last_values "$TMP/direct.txt") $(last_values "$TMP/mixed.txt")
+    diffs=$(awk -v a="$1" -v b="$2" -v c="$3" -v d="$4" -v e="$5" -v f="$6" -v g="$7" -v h="$8" 'BEGIN {
+        m = a - e; if (m < 0) m = -m
+        t = b - f; if (t < 0) t = -t; if (t > m) m = t
+        t = c - g; if (t < 0) t = -t; if (t > m) m = t
+        t = d - h; if (t < 0) t = -t
+        printf "%.3e %.3e", m, t }')
+    printf "%-12s %4s/%-3s %14s %14s %14s\n" "$name" "$passed" "$total" "$dev" $diffs
+    worst=$(awk -v a="$worst" -v b="$dev" 'BEGIN { print (b + 0 > a + 0) ? b : a }')
+done
+echo "largest force deviation from fp64: $worst"
+exit $status
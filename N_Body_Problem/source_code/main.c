@@ -1,10 +1,36 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <sys/mman.h>
 #include <omp.h>
 #include "nbody.h"
 
+// 粒子与力的数组放在堆上，N 不再受栈大小限制。小数组按缓存行（64 字节）对齐，
+// 超过 2 MB 的数组按 2 MB 对齐并建议内核使用透明大页。分配后由各 OpenMP 线程
+// 按 schedule(static) 的划分逐元素清零，页面的首次写入（first-touch）发生在
+// 之后按同样划分处理这些粒子的线程上，多路 NUMA 机器上内存落在本地结点
+#define HUGE_PAGE_SIZE (2 << 20)
+
+static void *alloc_array(int count, size_t size) {
+    size_t bytes = (size_t)count * size, align = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 64;
+    bytes = (bytes + align - 1) / align * align;
+    char *p = aligned_alloc(align, bytes > 0 ? bytes : align);
+    if (p == NULL) {
+        printf("out of memory: %zu bytes\n", bytes);
+        exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    if (align == HUGE_PAGE_SIZE)
+        madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < count; i++)
+        memset(p + (size_t)i * size, 0, size);
+    return p;
+}
+
 int main(int argc, char *argv[]) {
     int N;
     // 处理输入参数，选择问题规模
@@ -17,8 +43,10 @@ int main(int argc, char *argv[]) {
     read_ref(ref, argv[1]);
     srand(ref[33]); // 固定初始化随机数，用于正确性检验
     N = (int)ref[34];
-    Particle particles[N];
-    double fx[N], fy[N], fz[N];
+    Particle *particles = alloc_array(N, sizeof(Particle));
+    double *fx = alloc_array(N, sizeof(double));
+    double *fy = alloc_array(N, sizeof(double));
+    double *fz = alloc_array(N, sizeof(double));
     double initial_momentum_x=0, initial_momentum_y=0, initial_momentum_z=0;
     double current_momentum_x=0, current_momentum_y=0, current_momentum_z=0;
     double initial_energy=0, current_energy=0;
@@ -94,6 +122,10 @@ int main(int argc, char *argv[]) {
         }
     }
     printf("total simulation ends in %f sec\n", total_time);
+    free(particles);
+    free(fx);
+    free(fy);
+    free(fz);
     return 0;
 }
 
@@ -1,78 +1,1334 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <omp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include "nbody.h"
 
-// 计算粒子之间的引力
-void compute_forces(Particle particles[], double fx[], double fy[], double fz[], int N) {
-    for (int i = 0; i < N; i++) {
-        fx[i] = fy[i] = fz[i] = 0.0;
-        for (int j = 0; j < N; j++) {
-            if (i != j) {
-                double dx = particles[j].x - particles[i].x;
-                double dy = particles[j].y - particles[i].y;
-                double dz = particles[j].z - particles[i].z;
-                double dist = sqrt(dx * dx + dy * dy + dz * dz);
-                if (dist > 1e-5) { // 避免除以零的错误
-                    double F = G * particles[i].mass * particles[j].mass / (dist * dist);
-                    fx[i] += F * dx / dist;
-                    fy[i] += F * dy / dist;
-                    fz[i] += F * dz / dist;
+// 力的计算模式，由环境变量 NBODY_FORCE 选择：
+//   direct    （默认）每个粒子独立累加全部 N-1 个作用力，按 i 并行，与串行版本逐位一致
+//   rsqrt     同 direct，但每对只算一次 1/dist，用乘法代替 sqrt 之外的三次除法
+//   symmetric 利用牛顿第三定律，每对 i<j 只计算一次并把 ±F 分别累加到两个粒子
+//   tree      Barnes–Hut 八叉树近似，O(N log N)，精度由 NBODY_THETA 控制
+//   mixed     混合精度：距离用单精度计算（向量宽度加倍），力用双精度累加
+enum { FORCE_DIRECT, FORCE_RSQRT, FORCE_SYMMETRIC, FORCE_TREE, FORCE_MIXED };
+
+static int force_mode(void) {
+    static int mode = -1;
+    if (mode < 0) {
+        const char *env = getenv("NBODY_FORCE");
+        mode = FORCE_DIRECT;
+        if (env && strcmp(env, "symmetric") == 0)
+            mode = FORCE_SYMMETRIC;
+        else if (env && strcmp(env, "rsqrt") == 0)
+            mode = FORCE_RSQRT;
+        else if (env && strcmp(env, "tree") == 0)
+            mode = FORCE_TREE;
+        else if (env && strcmp(env, "mixed") == 0)
+            mode = FORCE_MIXED;
+        else if (env && strcmp(env, "direct") != 0)
+            fprintf(stderr, "Warning: unknown NBODY_FORCE=%s, using direct\n", env);
+    }
+    return mode;
+}
+
+// 能量的计算方式，由环境变量 NBODY_ENERGY 选择：
+//   exact （默认）compute_total_energy 单独做一遍 O(N²) 的势能求和
+//   fused 势能 -G*mi*mj/dist 在下一步计算力的同一遍扫描中顺带累加，
+//         compute_total_energy 返回的是上一步结束时的能量（晚一步），
+//         包括最后一步；没有可用记录时才做完整计算
+enum { ENERGY_EXACT, ENERGY_FUSED };
+
+static int energy_mode(void) {
+    static int mode = -1;
+    if (mode < 0) {
+        const char *env = getenv("NBODY_ENERGY");
+        mode = ENERGY_EXACT;
+        if (env && strcmp(env, "fused") == 0)
+            mode = ENERGY_FUSED;
+        else if (env && strcmp(env, "exact") != 0)
+            fprintf(stderr, "Warning: unknown NBODY_ENERGY=%s, using exact\n", env);
+    }
+    return mode;
+}
+
+// fused 模式下由 compute_forces 记录的能量：动能取更新之前的速度，
+// 势能按行累加到 row_pot[i]（第 i 行只含 j > i），再按 i 递增顺序求和。
+// state_gen 是粒子状态的代数，每次 update_particles 加一；fused_gen 记下
+// 这份能量属于哪一代，compute_total_energy 据此判断记录是否可用
+static double *row_pot = NULL;
+static int row_pot_cap = 0;
+static double fused_kinetic = 0.0, fused_potential = 0.0;
+static const Particle *fused_particles = NULL;
+static int fused_n = 0;
+static unsigned state_gen = 0, fused_gen = 0;
+
+
+// 线程组的执行方式，由环境变量 NBODY_TEAM 选择：
+//   persistent（默认）工作线程在第一次调用时创建并一直保留，绑定到与 OpenMP
+//              线程相同的 place 上，两次调用之间先自旋等待下一项任务，
+//              等不到就睡眠，任务内部的同步用同样的屏障，每个函数不再
+//              付出一次 fork/join 的代价
+//   omp        每项任务是一个普通的 #pragma omp parallel 区域
+// 两种方式执行的是同一组任务函数，结果逐位一致。
+enum { TEAM_PERSISTENT, TEAM_OMP };
+
+static int team_mode(void) {
+    static int mode = -1;
+    if (mode < 0) {
+        const char *env = getenv("NBODY_TEAM");
+        mode = TEAM_PERSISTENT;
+        if (env && strcmp(env, "omp") == 0)
+            mode = TEAM_OMP;
+        else if (env && strcmp(env, "persistent") != 0)
+            fprintf(stderr, "Warning: unknown NBODY_TEAM=%s, using persistent\n", env);
+    }
+    return mode;
+}
+
+// 任务函数：线程组中每个线程以自己的 (tid, nthreads) 各调用一次
+typedef void (*TeamJob)(int tid, int nthreads, void *ctx);
+
+static int slice(int n, int t, int T) {
+    return (int)((long long)n * t / T);
+}
+
+static inline void spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// 等待 *word 不再等于 value：先自旋 spin_limit 次，仍未变化就在条件变量上睡眠。
+// 线程数多于可用核数时 spin_limit 为 0，直接睡眠，不把时间片耗在空转上
+// （与 libgomp 在超额订阅时缩短自旋的做法相同）。改写 *word 的一方随后调用
+// park_wake。睡眠前后对 park_waiters 与 *word 的访问都是顺序一致的：要么写方
+// 看到有线程在睡并唤醒它，要么睡眠方在加锁后已经看到新值，不会漏掉唤醒
+#define SPIN_LIMIT 4096
+static int spin_limit = SPIN_LIMIT;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int park_waiters = 0;
+
+static void park_while(atomic_int *word, int value) {
+    for (int spins = 0; spins < spin_limit; spins++) {
+        if (atomic_load_explicit(word, memory_order_acquire) != value)
+            return;
+        spin_pause();
+    }
+    pthread_mutex_lock(&park_lock);
+    atomic_fetch_add(&park_waiters, 1);
+    while (atomic_load(word) == value)
+        pthread_cond_wait(&park_cond, &park_lock);
+    atomic_fetch_sub(&park_waiters, 1);
+    pthread_mutex_unlock(&park_lock);
+}
+
+static void park_wake(void) {
+    if (atomic_load(&park_waiters) > 0) {
+        pthread_mutex_lock(&park_lock);
+        pthread_cond_broadcast(&park_cond);
+        pthread_mutex_unlock(&park_lock);
+    }
+}
+
+// 持久线程组：tid 0 是调用者自己，另外 team_threads-1 个工作线程
+// 在 team_gen 上等待，team_gen 每加一表示发布了一项新任务
+static int team_threads = 0;
+static TeamJob team_job = NULL;
+static void *team_ctx = NULL;
+static _Alignas(64) atomic_int team_gen = 0;
+
+// 翻转标志的计数屏障（sense-reversing）：最后到达的线程把计数清零并翻转
+// bar_sense，其余线程等到标志翻转为止。每个线程记住自己期待的标志值，
+// 所以同一个屏障可以连续使用而不需要第二次同步
+static _Alignas(64) atomic_int bar_count = 0;
+static _Alignas(64) atomic_int bar_sense = 0;
+static _Thread_local int bar_local = 0;
+
+static void spin_barrier(int n) {
+    int sense = bar_local = !bar_local;
+    if (atomic_fetch_add_explicit(&bar_count, 1, memory_order_acq_rel) == n - 1) {
+        atomic_store_explicit(&bar_count, 0, memory_order_relaxed);
+        atomic_store(&bar_sense, sense);
+        park_wake();
+    } else {
+        park_while(&bar_sense, !sense);
+    }
+}
+
+static void *team_worker(void *arg) {
+    int tid = (int)(intptr_t)arg, seen = 0;
+    for (;;) {
+        park_while(&team_gen, seen);
+        seen = atomic_load_explicit(&team_gen, memory_order_acquire);
+        team_job(tid, team_threads, team_ctx);
+        spin_barrier(team_threads);
+    }
+    return NULL;
+}
+
+// 第 t 个线程的 place，按 OMP_PROC_BIND 的策略从调用者所在的 place 数起，
+// 与同样大小的 #pragma omp parallel 区域中第 t 个线程的位置一致；
+// 未启用绑定时返回 -1。main.c 按 OpenMP 线程做的首次访问因此仍然落在本地
+static int team_place(int t, int T) {
+    int P = omp_get_num_places();
+    omp_proc_bind_t bind = omp_get_proc_bind();
+    if (bind == omp_proc_bind_false || P <= 0)
+        return -1;
+    int p0 = omp_get_place_num() < 0 ? 0 : omp_get_place_num();
+    if (bind == omp_proc_bind_master)
+        return p0;
+    if (bind == omp_proc_bind_spread || T > P)
+        return (p0 + (int)((long long)t * P / T)) % P;
+    return (p0 + t) % P;
+}
+
+static void bind_to_place(pthread_t thread, int place) {
+#ifdef __linux__
+    int n = omp_get_place_num_procs(place);
+    int *ids = malloc(sizeof(int) * (n > 0 ? n : 1));
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    omp_get_place_proc_ids(place, ids);
+    for (int k = 0; k < n; k++)
+        if (ids[k] >= 0 && ids[k] < CPU_SETSIZE)
+            CPU_SET(ids[k], &set);
+    if (n > 0)
+        pthread_setaffinity_np(thread, sizeof(set), &set);
+    free(ids);
+#else
+    (void)thread;
+    (void)place;
+#endif
+}
+
+// 线程组的大小，第一次调用时按 OMP_NUM_THREADS 创建工作线程
+static int team_size(void) {
+    if (team_mode() == TEAM_OMP)
+        return omp_get_max_threads();
+    if (team_threads == 0) {
+        int T = omp_get_max_threads();
+        team_threads = T;
+        if (T > omp_get_num_procs())
+            spin_limit = 0;
+        for (int t = 1; t < T; t++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, team_worker, (void *)(intptr_t)t) != 0) {
+                fprintf(stderr, "Warning: only %d of %d threads started\n", t, T);
+                team_threads = t;
+                break;
+            }
+            int place = team_place(t, T);
+            if (place >= 0)
+                bind_to_place(thread, place);
+            pthread_detach(thread);
+        }
+    }
+    return team_threads;
+}
+
+// 在线程组上执行一项任务，所有线程完成后返回
+static void team_run(TeamJob job, void *ctx) {
+    int T = team_size();
+    if (team_mode() == TEAM_OMP) {
+        #pragma omp parallel num_threads(T)
+        job(omp_get_thread_num(), omp_get_num_threads(), ctx);
+        return;
+    }
+    team_job = job;
+    team_ctx = ctx;
+    atomic_fetch_add(&team_gen, 1);
+    park_wake();
+    job(0, T, ctx);
+    spin_barrier(T);
+}
+
+// 任务内部的屏障
+static void team_barrier(void) {
+    if (team_mode() == TEAM_OMP) {
+        #pragma omp barrier
+    } else {
+        spin_barrier(team_threads);
+    }
+}
+// 向量宽度：x86 上 AVX 为 4 个 double，SSE2 与 aarch64 NEON 为 2 个，
+// 其它平台退化为 1。四则运算与比较用编译器的向量扩展，只有 sqrt 需要指令集内建函数。
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VLEN 4
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VLEN 2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VLEN 2
+#else
+#define VLEN 1
+#endif
+typedef double vdouble __attribute__((vector_size(VLEN * sizeof(double))));
+typedef long long vmask __attribute__((vector_size(VLEN * sizeof(long long))));
+
+static inline vdouble vsqrt(vdouble x) {
+#if defined(__AVX__)
+    return (vdouble)_mm256_sqrt_pd((__m256d)x);
+#elif defined(__SSE2__)
+    return (vdouble)_mm_sqrt_pd((__m128d)x);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    return (vdouble)vsqrtq_f64((float64x2_t)x);
+#else
+    for (int l = 0; l < VLEN; l++)
+        x[l] = sqrt(x[l]);
+    return x;
+#endif
+}
+
+// 每次同时计算 KVEC 个向量，掩盖除法与开方的延迟
+#define KVEC 2
+#define LANES (VLEN * KVEC)
+
+// mixed 模式的单精度向量：寄存器宽度相同，一个向量正好装下 LANES 个 i
+typedef float vfloat __attribute__((vector_size(LANES * sizeof(float))));
+typedef int vmaskf __attribute__((vector_size(LANES * sizeof(int))));
+typedef float vhalf __attribute__((vector_size(VLEN * sizeof(float))));
+
+// 1/sqrt(x)：硬件近似值（x86 约 12 位，NEON 约 8 位）加牛顿迭代，达到单精度
+static inline vfloat vrsqrt(vfloat x) {
+#if defined(__AVX__)
+    vfloat y = (vfloat)_mm256_rsqrt_ps((__m256)x);
+#elif defined(__SSE2__)
+    vfloat y = (vfloat)_mm_rsqrt_ps((__m128)x);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    vfloat y = (vfloat)vrsqrteq_f32((float32x4_t)x);
+    y = y * (1.5f - 0.5f * x * y * y);
+#else
+    vfloat y;
+    for (int l = 0; l < LANES; l++)
+        y[l] = 1.0f / sqrtf(x[l]);
+#endif
+    return y * (1.5f - 0.5f * x * y * y);
+}
+
+// 单精度向量的前后两半分别转换为双精度，与 LaneAcc 的 KVEC 个向量对应
+static inline void widen_add(vdouble acc[KVEC], vfloat v) {
+    for (int k = 0; k < KVEC; k++) {
+        vhalf h;
+        memcpy(&h, (const float *)&v + k * VLEN, sizeof(h));
+        acc[k] += __builtin_convertvector(h, vdouble);
+    }
+}
+
+// 位置与质量的 SoA 镜像，每次扫描开始时从 particles 同步（O(N)），
+// 长度补齐到 LANES 的倍数，补齐部分的结果直接丢弃。mixed 模式另有一份单精度镜像
+static double *soa_x = NULL, *soa_y = NULL, *soa_z = NULL, *soa_m = NULL;
+static float *soaf_x = NULL, *soaf_y = NULL, *soaf_z = NULL, *soaf_m = NULL;
+static int soa_cap = 0;
+
+static void soa_reserve(int N) {
+    int cap = (N + LANES - 1) / LANES * LANES;
+    if (cap > soa_cap) {
+        free(soa_x);
+        soa_x = (double *)aligned_alloc(64, sizeof(double) * 4 * (size_t)cap);
+        soa_y = soa_x + cap;
+        soa_z = soa_y + cap;
+        soa_m = soa_z + cap;
+        free(soaf_x);
+        soaf_x = (float *)aligned_alloc(64, sizeof(float) * 4 * (size_t)cap);
+        soaf_y = soaf_x + cap;
+        soaf_z = soaf_y + cap;
+        soaf_m = soaf_z + cap;
+        soa_cap = cap;
+    }
+}
+
+// 同步镜像中 [begin, end) 这一段
+static void soa_fill(const Particle particles[], int N, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        int valid = i < N;
+        soa_x[i] = valid ? particles[i].x : 0.0;
+        soa_y[i] = valid ? particles[i].y : 0.0;
+        soa_z[i] = valid ? particles[i].z : 0.0;
+        soa_m[i] = valid ? particles[i].mass : 0.0;
+    }
+    if (force_mode() == FORCE_MIXED) {
+        for (int i = begin; i < end; i++) {
+            soaf_x[i] = (float)soa_x[i];
+            soaf_y[i] = (float)soa_y[i];
+            soaf_z[i] = (float)soa_z[i];
+            soaf_m[i] = (float)soa_m[i];
+        }
+    }
+}
+
+// 一组 LANES 个 i 的累加器：三个力分量与势能，跨 j 分块保存
+typedef struct {
+    vdouble x[KVEC], y[KVEC], z[KVEC], p[KVEC];
+} LaneAcc;
+
+// LANES 个相邻的 i 同时计算，向量化在 i 方向上进行：每个 lane 仍按 j 递增
+// 顺序累加，且每步运算与串行版本相同（i == j 时 dist 为 0，同样被
+// dist > 1e-5 排除），所以 direct 模式的结果逐位一致。本函数处理 j ∈ [j0, j1)，
+// 按 j 分块依次调用即可保持求和顺序。
+// force 为 1 时累加作用力；recip 为 1 时每对只做一次除法 inv = 1/dist（rsqrt 模式）；
+// pot 为 1 时累加 j > i 的势能 G*mi*mj/dist。
+static inline __attribute__((always_inline)) void tile_lanes(int i0, int j0, int j1, int force, int recip, int pot,
+                                                             LaneAcc *acc) {
+    vdouble xi[KVEC], yi[KVEC], zi[KVEC], mi[KVEC], ax[KVEC], ay[KVEC], az[KVEC], ap[KVEC];
+    vmask idx[KVEC];
+    for (int k = 0; k < KVEC; k++) {
+        for (int l = 0; l < VLEN; l++)
+            idx[k][l] = i0 + k * VLEN + l;
+        xi[k] = *(const vdouble *)&soa_x[i0 + k * VLEN];
+        yi[k] = *(const vdouble *)&soa_y[i0 + k * VLEN];
+        zi[k] = *(const vdouble *)&soa_z[i0 + k * VLEN];
+        mi[k] = *(const vdouble *)&soa_m[i0 + k * VLEN];
+        ax[k] = acc->x[k];
+        ay[k] = acc->y[k];
+        az[k] = acc->z[k];
+        ap[k] = acc->p[k];
+    }
+    for (int j = j0; j < j1; j++) {
+        double xj = soa_x[j], yj = soa_y[j], zj = soa_z[j], mj = soa_m[j];
+        // 只有 j > i0 时本组中才可能有 j > i 的 lane
+        int with_pot = pot && j > i0;
+        for (int k = 0; k < KVEC; k++) {
+            vdouble dx = xj - xi[k];
+            vdouble dy = yj - yi[k];
+            vdouble dz = zj - zi[k];
+            vdouble dist = vsqrt(dx * dx + dy * dy + dz * dz);
+            vmask far = dist > 1e-5; // 避免除以零的错误
+            vdouble inv = dist;
+            if (recip)
+                inv = 1.0 / dist;
+            if (force) {
+                vdouble ex, ey, ez;
+                if (recip) {
+                    vdouble F = G * mi[k] * mj * (inv * inv);
+                    ex = F * dx * inv;
+                    ey = F * dy * inv;
+                    ez = F * dz * inv;
+                } else {
+                    vdouble F = G * mi[k] * mj / (dist * dist);
+                    ex = F * dx / dist;
+                    ey = F * dy / dist;
+                    ez = F * dz / dist;
                 }
+                ax[k] += (vdouble)((vmask)ex & far);
+                ay[k] += (vdouble)((vmask)ey & far);
+                az[k] += (vdouble)((vmask)ez & far);
+            }
+            if (with_pot) {
+                vdouble ep = recip ? G * mi[k] * mj * inv : G * mi[k] * mj / dist;
+                ap[k] += (vdouble)((vmask)ep & far & (j > idx[k]));
             }
         }
     }
+    for (int k = 0; k < KVEC; k++) {
+        acc->x[k] = ax[k];
+        acc->y[k] = ay[k];
+        acc->z[k] = az[k];
+        acc->p[k] = ap[k];
+    }
 }
 
-// 更新粒子的位置和速度
-void update_particles(Particle particles[], double fx[], double fy[], double fz[], int N) {
-    for (int i = 0; i < N; i++) {
-        particles[i].vx += fx[i] / particles[i].mass * DT;
-        particles[i].vy += fy[i] / particles[i].mass * DT;
-        particles[i].vz += fz[i] / particles[i].mass * DT;
-        particles[i].x += particles[i].vx * DT;
-        particles[i].y += particles[i].vy * DT;
-        particles[i].z += particles[i].vz * DT;
+// mixed 模式的内核：位置差、距离与 mj/r³ 用单精度计算，每个向量覆盖 LANES 个 i，
+// 每对的贡献转换为双精度后累加。累加的是 sum_j mj*d/r³（与 pot 为 1 时的
+// sum_j mj/r），G*mi 由 tiled_block 在写出时统一乘上。
+static inline __attribute__((always_inline)) void tile_lanes_mixed(int i0, int j0, int j1, int pot, LaneAcc *acc) {
+    vfloat xi = *(const vfloat *)&soaf_x[i0], yi = *(const vfloat *)&soaf_y[i0], zi = *(const vfloat *)&soaf_z[i0];
+    vdouble ax[KVEC], ay[KVEC], az[KVEC], ap[KVEC];
+    vmaskf idx;
+    for (int l = 0; l < LANES; l++)
+        idx[l] = i0 + l;
+    for (int k = 0; k < KVEC; k++) {
+        ax[k] = acc->x[k];
+        ay[k] = acc->y[k];
+        az[k] = acc->z[k];
+        ap[k] = acc->p[k];
+    }
+    for (int j = j0; j < j1; j++) {
+        vfloat dx = soaf_x[j] - xi;
+        vfloat dy = soaf_y[j] - yi;
+        vfloat dz = soaf_z[j] - zi;
+        vfloat r2 = dx * dx + dy * dy + dz * dz;
+        vmaskf far = r2 > 1e-10f; // dist > 1e-5，同时排除 i == j
+        vfloat inv = vrsqrt(r2);
+        vfloat s = soaf_m[j] * (inv * inv * inv);
+        widen_add(ax, (vfloat)((vmaskf)(s * dx) & far));
+        widen_add(ay, (vfloat)((vmaskf)(s * dy) & far));
+        widen_add(az, (vfloat)((vmaskf)(s * dz) & far));
+        if (pot && j > i0)
+            widen_add(ap, (vfloat)((vmaskf)(soaf_m[j] * inv) & far & (j > idx)));
+    }
+    for (int k = 0; k < KVEC; k++) {
+        acc->x[k] = ax[k];
+        acc->y[k] = ay[k];
+        acc->z[k] = az[k];
+        acc->p[k] = ap[k];
     }
 }
 
-// 计算体系总动量的三个分量
-void compute_total_momentum(Particle particles[], double *px, double *py, double *pz, int N) {
-    *px = *py = *pz = 0.0;
-	double x=0.0,y=0.0,z=0.0;
-    for (int i = 0; i < N; i++) {
-        x += particles[i].mass * particles[i].vx;
-        y += particles[i].mass * particles[i].vy;
-        z += particles[i].mass * particles[i].vz;
+// 分块调度：相互作用矩阵切成 i 块 × j 块。一个 j 块的 SoA 数据
+// （4 个数组 × TILE_J 个 double，16 KB）留在 L1 中，被同一 i 块内的
+// 各组 lane 依次复用；i 块以 dynamic 方式分给线程，三角形的势能扫描
+// 也能自动均衡。
+#define TILE_J 512
+#define TILE_I_GROUPS 8
+
+// 每个 i 块的 lane 组数：保证每个线程至少能分到约 4 个块
+static int block_groups(int N) {
+    int groups = (N + LANES - 1) / LANES;
+    int ib = groups / (4 * team_size());
+    return ib < 1 ? 1 : ib > TILE_I_GROUPS ? TILE_I_GROUPS : ib;
+}
+
+// 处理第 b 个 i 块的全部 j（pot 且不算力时只需 j > i 的部分），
+// 结果写入 fx/fy/fz 与 row_pot。kernel 为 FORCE_DIRECT、FORCE_RSQRT 或 FORCE_MIXED
+static inline __attribute__((always_inline)) void tiled_block(int b, int ib, int N, int force, int kernel, int pot,
+                                                              double fx[], double fy[], double fz[]) {
+    LaneAcc acc[TILE_I_GROUPS];
+    int g_begin = b * ib, g_end = g_begin + ib, groups = (N + LANES - 1) / LANES;
+    if (g_end > groups)
+        g_end = groups;
+    memset(acc, 0, sizeof(acc));
+    int j_first = force ? 0 : g_begin * LANES + 1;
+    for (int jt = j_first; jt < N; jt += TILE_J) {
+        int jt_end = jt + TILE_J < N ? jt + TILE_J : N;
+        for (int g = g_begin; g < g_end; g++) {
+            // 势能只需 j > i，该组的 lane 全部满足 j <= i 时整块跳过
+            if (!force && jt_end <= g * LANES)
+                continue;
+            if (kernel == FORCE_MIXED)
+                tile_lanes_mixed(g * LANES, jt, jt_end, pot, &acc[g - g_begin]);
+            else
+                tile_lanes(g * LANES, jt, jt_end, force, kernel == FORCE_RSQRT, pot, &acc[g - g_begin]);
+        }
+    }
+    for (int g = g_begin; g < g_end; g++) {
+        for (int l = 0; l < LANES && g * LANES + l < N; l++) {
+            int i = g * LANES + l;
+            const LaneAcc *a = &acc[g - g_begin];
+            double scale = kernel == FORCE_MIXED ? G * soa_m[i] : 1.0;
+            if (force) {
+                fx[i] = scale * a->x[l / VLEN][l % VLEN];
+                fy[i] = scale * a->y[l / VLEN][l % VLEN];
+                fz[i] = scale * a->z[l / VLEN][l % VLEN];
+            }
+            if (pot)
+                row_pot[i] = scale * a->p[l / VLEN][l % VLEN];
+        }
     }
-	*px=x;
-	*py=y;
-	*pz=z;
 }
 
-// 计算系统的总能量（动能和势能）
-double compute_total_energy(Particle particles[], int N) {
-    double total_kinetic = 0.0;
-    double total_potential = 0.0;
+static void row_pot_reserve(int N) {
+    if (N > row_pot_cap) {
+        free(row_pot);
+        row_pot = (double *)malloc(sizeof(double) * N);
+        row_pot_cap = N;
+    }
+}
 
-    // 计算动能
-    for (int i = 0; i < N; i++) {
-        double v2 = particles[i].vx * particles[i].vx + particles[i].vy * particles[i].vy + particles[i].vz * particles[i].vz;
-        total_kinetic += 0.5 * particles[i].mass * v2;
+// 对称模式的工作区：每个线程一块私有的力缓冲区（避免原子操作），
+// 以及按三角形划分的行区间 rows[t] .. rows[t+1]。各线程的缓冲区间隔
+// sym_stride 个 double，补齐到缓存行，相邻线程不会写到同一行
+static double *sym_buf = NULL;
+static int *sym_rows = NULL;
+static int sym_n = 0, sym_threads = 0;
+static size_t sym_stride = 0;
+
+static void symmetric_setup(int N, int T) {
+    if (N == sym_n && T == sym_threads)
+        return;
+    free(sym_buf);
+    free(sym_rows);
+    sym_stride = ((size_t)3 * N + 7) / 8 * 8;
+    sym_buf = (double *)aligned_alloc(64, sizeof(double) * (sym_stride * T > 0 ? sym_stride * T : 8));
+    sym_rows = (int *)malloc(sizeof(int) * (T + 1));
+    // 第 i 行有 N-1-i 对，划分使每个线程分到的对数大致相等
+    double total = (double)N * (N - 1) / 2, pairs = 0;
+    int t = 1;
+    sym_rows[0] = 0;
+    for (int i = 0; i < N && t < T; i++) {
+        pairs += N - 1 - i;
+        while (t < T && pairs >= total * t / T)
+            sym_rows[t++] = i + 1;
     }
-    // 计算势能
-    for(int i = 0; i < N; i++){
+    while (t <= T)
+        sym_rows[t++] = N;
+    sym_n = N;
+    sym_threads = T;
+}
+
+// 每对 i<j 只计算一次。线程 t 依次处理自己的行，第 i 行先读出缓冲区中
+// 已由更小的行散射来的分量，再按 j 递增累加，所以单线程时每个粒子各项的
+// 相加顺序与串行版本相同；但散射给 j 的一项沿用 i 这一侧算出的
+// G*mi*mj，与串行版本在 j 处算的 G*mj*mi 舍入不同，结果只在 ERR 之内一致。
+static void symmetric_rows(int N, int pot, int t) {
+    double *bx = sym_buf + sym_stride * t, *by = bx + N, *bz = by + N;
+    int row_begin = sym_rows[t], row_end = sym_rows[t + 1];
+    // 本线程只会写到下标 >= row_begin 的粒子
+    for (int i = row_begin; i < N; i++)
+        bx[i] = by[i] = bz[i] = 0.0;
+
+    for (int i = row_begin; i < row_end; i++) {
+        double xi = soa_x[i], yi = soa_y[i], zi = soa_z[i], mi = soa_m[i];
+        double sx = bx[i], sy = by[i], sz = bz[i], sp = 0.0;
         for (int j = i + 1; j < N; j++) {
-            double dx = particles[j].x - particles[i].x;
-            double dy = particles[j].y - particles[i].y;
-            double dz = particles[j].z - particles[i].z;
+            double dx = soa_x[j] - xi;
+            double dy = soa_y[j] - yi;
+            double dz = soa_z[j] - zi;
             double dist = sqrt(dx * dx + dy * dy + dz * dz);
             if (dist > 1e-5) {
-                total_potential -= G * particles[i].mass * particles[j].mass / dist;
+                double F = G * mi * soa_m[j] / (dist * dist);
+                double ex = F * dx / dist, ey = F * dy / dist, ez = F * dz / dist;
+                sx += ex;
+                sy += ey;
+                sz += ez;
+                bx[j] -= ex;
+                by[j] -= ey;
+                bz[j] -= ez;
+                if (pot)
+                    sp += G * mi * soa_m[j] / dist;
             }
         }
+        if (pot)
+            row_pot[i] = sp;
+        bx[i] = sx;
+        by[i] = sy;
+        bz[i] = sz;
+    }
+}
+
+// 按 t 递增的固定顺序合并各线程缓冲区的 [begin, end) 段，结果与线程调度无关
+static void symmetric_merge(double fx[], double fy[], double fz[], int N, int T, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        double sx = 0.0, sy = 0.0, sz = 0.0;
+        for (int u = 0; u < T && sym_rows[u] <= i; u++) {
+            const double *ux = sym_buf + sym_stride * u;
+            sx += ux[i];
+            sy += ux[N + i];
+            sz += ux[2 * N + i];
+        }
+        fx[i] = sx;
+        fy[i] = sy;
+        fz[i] = sz;
+    }
+}
+
+// 可复现的并行归约：n 项按下标切成固定大小 REDUCE_CHUNK 的块，块内用
+// Neumaier 补偿求和，块和再按固定形状的二叉树两两相加。分块与树的形状只由
+// n 决定，与线程数和调度无关，所以任意线程数下结果逐位相同。
+#define REDUCE_CHUNK 256
+static double *reduce_terms = NULL, *reduce_part = NULL;
+static int reduce_cap = 0;
+
+// update_particles 顺带算出的动量块和，供紧接着的 compute_total_momentum 使用
+static int momentum_ready = 0, momentum_n = 0;
+
+static int reduce_chunks(int n) {
+    return (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+}
+
+// N 个粒子所需的临时数组：reduce_terms 放 3N 项，reduce_part 放 5 组块和，
+// 依次是动能、势能与动量的三个分量
+static void reduce_reserve(int N) {
+    if (N > reduce_cap) {
+        free(reduce_terms);
+        free(reduce_part);
+        reduce_terms = (double *)malloc(sizeof(double) * 3 * (size_t)N);
+        reduce_part = (double *)malloc(sizeof(double) * 5 * (size_t)reduce_chunks(N));
+        reduce_cap = N;
+        momentum_ready = 0;
     }
+}
 
-    return total_kinetic + total_potential;
+// 第 c 块的补偿和
+static double chunk_sum(const double *terms, int n, int c) {
+    int end = (c + 1) * REDUCE_CHUNK < n ? (c + 1) * REDUCE_CHUNK : n;
+    double sum = 0.0, comp = 0.0;
+    for (int i = c * REDUCE_CHUNK; i < end; i++) {
+        double t = sum + terms[i];
+        comp += fabs(sum) >= fabs(terms[i]) ? (sum - t) + terms[i] : (terms[i] - t) + sum;
+        sum = t;
+    }
+    return sum + comp;
+}
+
+// 线程 tid 负责的那一段块
+static void reduce_partials(const double *terms, int n, double *part, int tid, int T) {
+    int chunks = reduce_chunks(n);
+    for (int c = slice(chunks, tid, T); c < slice(chunks, tid + 1, T); c++)
+        part[c] = chunk_sum(terms, n, c);
+}
+
+static double reduce_tree(double *part, int n) {
+    int chunks = reduce_chunks(n);
+    if (chunks == 0)
+        return 0.0;
+    for (int width = 1; width < chunks; width *= 2)
+        for (int c = 0; c + width < chunks; c += 2 * width)
+            part[c] += part[c + width];
+    return part[0];
+}
+
+// 一次 O(N²) 扫描：force 为 1 时计算作用力，energy 为 1 时同时求出动能
+// （扫描开始时的速度）与势能。同步 SoA、计算与归约是同一项任务的几个
+// 阶段，中间只隔一个屏障。
+typedef struct {
+    const Particle *particles;
+    double *fx, *fy, *fz;
+    int N, force, kernel, symmetric, energy;
+    int ib, blocks;
+    atomic_int next_block;
+    double kinetic, potential;
+} Sweep;
+
+static void sweep_block(const Sweep *s, int b) {
+    if (!s->force)
+        tiled_block(b, s->ib, s->N, 0, FORCE_DIRECT, 1, NULL, NULL, NULL);
+    else if (s->kernel == FORCE_RSQRT)
+        s->energy ? tiled_block(b, s->ib, s->N, 1, FORCE_RSQRT, 1, s->fx, s->fy, s->fz)
+                  : tiled_block(b, s->ib, s->N, 1, FORCE_RSQRT, 0, s->fx, s->fy, s->fz);
+    else if (s->kernel == FORCE_MIXED)
+        s->energy ? tiled_block(b, s->ib, s->N, 1, FORCE_MIXED, 1, s->fx, s->fy, s->fz)
+                  : tiled_block(b, s->ib, s->N, 1, FORCE_MIXED, 0, s->fx, s->fy, s->fz);
+    else
+        s->energy ? tiled_block(b, s->ib, s->N, 1, FORCE_DIRECT, 1, s->fx, s->fy, s->fz)
+                  : tiled_block(b, s->ib, s->N, 1, FORCE_DIRECT, 0, s->fx, s->fy, s->fz);
+}
+
+static void sweep_job(int tid, int T, void *ctx) {
+    Sweep *s = (Sweep *)ctx;
+    const Particle *particles = s->particles;
+    int N = s->N, begin = slice(N, tid, T), end = slice(N, tid + 1, T);
+
+    soa_fill(particles, N, slice(soa_cap, tid, T), slice(soa_cap, tid + 1, T));
+    if (s->energy) {
+        for (int i = begin; i < end; i++) {
+            double v2 = particles[i].vx * particles[i].vx + particles[i].vy * particles[i].vy + particles[i].vz * particles[i].vz;
+            reduce_terms[i] = 0.5 * particles[i].mass * v2;
+        }
+    }
+    if (s->symmetric && tid == 0)
+        symmetric_setup(N, T);
+    team_barrier();
+
+    if (s->symmetric) {
+        symmetric_rows(N, s->energy, tid);
+        team_barrier();
+        symmetric_merge(s->fx, s->fy, s->fz, N, T, begin, end);
+    } else {
+        // 动态调度：线程从共享计数器领取 i 块
+        int b;
+        while ((b = atomic_fetch_add_explicit(&s->next_block, 1, memory_order_relaxed)) < s->blocks)
+            sweep_block(s, b);
+    }
+
+    if (s->energy) {
+        team_barrier();
+        reduce_partials(reduce_terms, N, reduce_part, tid, T);
+        reduce_partials(row_pot, N, reduce_part + reduce_chunks(N), tid, T);
+    }
+}
+
+static void sweep_run(Sweep *s) {
+    int N = s->N;
+    soa_reserve(N);
+    if (s->energy) {
+        row_pot_reserve(N);
+        reduce_reserve(N);
+    }
+    s->ib = block_groups(N);
+    s->blocks = ((N + LANES - 1) / LANES + s->ib - 1) / s->ib;
+    atomic_init(&s->next_block, 0);
+    team_run(sweep_job, s);
+    if (s->energy) {
+        // 块和的二叉树只有 N/REDUCE_CHUNK 项，由调用者完成
+        s->kinetic = reduce_tree(reduce_part, N);
+        s->potential = -reduce_tree(reduce_part + reduce_chunks(N), N);
+    }
+}
+
+// tree 模式（Barnes–Hut）：每步按 Morton 码对粒子排序并建立八叉树。
+// 结点的边长与它到质心的距离之比小于 θ 时，整个结点用质心处的总质量近似；
+// 否则展开子结点，叶结点内逐对计算（与 direct 相同的公式与 1e-5 判据）。
+// θ 由环境变量 NBODY_THETA 给出，默认 0.5，越小越精确，θ = 0 时每对都逐一计算。
+#define TREE_LEAF 8          // 叶结点最多容纳的粒子数
+#define TREE_BITS 21         // 每个坐标量化的位数，Morton 码共 63 位
+#define TREE_RADIX 8         // 基数排序每趟处理的位数
+#define TREE_WALK_CHUNK 64   // 遍历时线程每次领取的粒子数
+_Static_assert((3 * TREE_BITS + TREE_RADIX - 1) / TREE_RADIX % 2 == 0,
+               "radix sort must take an even number of passes");
+
+static double tree_theta(void) {
+    static double theta = -1.0;
+    if (theta < 0) {
+        const char *env = getenv("NBODY_THETA");
+        char *end = NULL;
+        theta = 0.5;
+        if (env) {
+            double v = strtod(env, &end);
+            if (end != env && *end == '\0' && v >= 0)
+                theta = v;
+            else
+                fprintf(stderr, "Warning: invalid NBODY_THETA=%s, using 0.5\n", env);
+        }
+    }
+    return theta;
+}
+
+typedef struct {
+    double x, y, z, m;   // 质心与总质量
+    double size;         // 结点立方体的边长
+    int begin, end;      // 结点内的粒子在排序后数组中的区间
+    int child, nchild;   // 子结点的起始下标与个数，叶结点 nchild 为 0
+    int level;           // 子结点按 Morton 码的第 level 个 3 位组划分
+} TreeNode;
+
+// 每个内部结点至少有两个子结点，叶结点非空，所以结点数不超过 2N
+static TreeNode *tree_nodes = NULL;
+static atomic_int tree_count;
+static int *tree_queue = NULL;
+static uint64_t *tree_key = NULL, *tree_key_tmp = NULL;
+static int *tree_idx = NULL, *tree_idx_tmp = NULL;
+static double *tree_x = NULL, *tree_y = NULL, *tree_z = NULL, *tree_m = NULL;
+static int tree_cap = 0;
+// 每个线程的包围盒（按 64 字节补齐）与基数排序直方图
+static double *tree_bounds = NULL;
+static int *tree_hist = NULL;
+static int tree_threads = 0;
+static double tree_origin[3], tree_size;
+
+static void tree_reserve(int N, int T) {
+    if (N > tree_cap) {
+        free(tree_nodes);
+        free(tree_queue);
+        free(tree_key);
+        free(tree_idx);
+        free(tree_x);
+        tree_nodes = (TreeNode *)malloc(sizeof(TreeNode) * 2 * (size_t)N);
+        tree_queue = (int *)malloc(sizeof(int) * 2 * (size_t)N);
+        tree_key = (uint64_t *)malloc(sizeof(uint64_t) * 2 * (size_t)N);
+        tree_key_tmp = tree_key + N;
+        tree_idx = (int *)malloc(sizeof(int) * 2 * (size_t)N);
+        tree_idx_tmp = tree_idx + N;
+        tree_x = (double *)malloc(sizeof(double) * 4 * (size_t)N);
+        tree_y = tree_x + N;
+        tree_z = tree_y + N;
+        tree_m = tree_z + N;
+        tree_cap = N;
+    }
+    if (T > tree_threads) {
+        free(tree_bounds);
+        free(tree_hist);
+        tree_bounds = (double *)aligned_alloc(64, sizeof(double) * 8 * T);
+        tree_hist = (int *)aligned_alloc(64, sizeof(int) * (1 << TREE_RADIX) * (size_t)T);
+        tree_threads = T;
+    }
+}
+
+// 21 位整数的每一位隔两位展开，三个坐标交织成 Morton 码
+static inline uint64_t spread_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+static inline uint64_t morton_key(double x, double y, double z, double scale) {
+    const double top = (1 << TREE_BITS) - 1;
+    double q[3] = {(x - tree_origin[0]) * scale, (y - tree_origin[1]) * scale, (z - tree_origin[2]) * scale};
+    uint64_t key = 0;
+    for (int d = 0; d < 3; d++) {
+        double v = q[d] < 0 ? 0 : q[d] > top ? top : q[d];
+        key |= spread_bits((uint64_t)v) << (2 - d);
+    }
+    return key;
+}
+
+static inline int tree_digit(int p, int level) {
+    return (int)(tree_key[p] >> (3 * (TREE_BITS - 1 - level))) & 7;
+}
+
+// 把结点 n 划分到子立方体中：先跳过所有粒子都落在同一子立方体的层，
+// 粒子数不超过 TREE_LEAF 或已到最细一层时成为叶结点。返回子结点个数
+static int tree_expand(int n) {
+    TreeNode *node = &tree_nodes[n];
+    int begin = node->begin, end = node->end, level = node->level;
+    while (level < TREE_BITS && tree_digit(begin, level) == tree_digit(end - 1, level))
+        level++;
+    node->level = level;
+    node->size = ldexp(tree_size, -level);
+    node->nchild = 0;
+    if (end - begin <= TREE_LEAF || level == TREE_BITS)
+        return 0;
+
+    // 区间内的粒子按第 level 位组递增排列，二分查找每个子立方体的起点
+    int bound[9], k = 0;
+    bound[0] = begin;
+    for (int d = 1; d < 8; d++) {
+        int lo = bound[d - 1], hi = end;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (tree_digit(mid, level) < d)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        bound[d] = lo;
+    }
+    bound[8] = end;
+    for (int d = 0; d < 8; d++)
+        k += bound[d + 1] > bound[d];
+
+    int child = atomic_fetch_add_explicit(&tree_count, k, memory_order_relaxed);
+    node->child = child;
+    node->nchild = k;
+    for (int d = 0; d < 8; d++) {
+        if (bound[d + 1] == bound[d])
+            continue;
+        TreeNode *c = &tree_nodes[child++];
+        c->begin = bound[d];
+        c->end = bound[d + 1];
+        c->level = level + 1;
+    }
+    return k;
+}
+
+// 质心与总质量：叶结点由粒子求得，内部结点由子结点求得
+static void tree_moments(int n) {
+    TreeNode *node = &tree_nodes[n];
+    double m = 0.0, x = 0.0, y = 0.0, z = 0.0;
+    if (node->nchild == 0) {
+        for (int p = node->begin; p < node->end; p++) {
+            m += tree_m[p];
+            x += tree_m[p] * tree_x[p];
+            y += tree_m[p] * tree_y[p];
+            z += tree_m[p] * tree_z[p];
+        }
+    } else {
+        for (int c = node->child; c < node->child + node->nchild; c++) {
+            m += tree_nodes[c].m;
+            x += tree_nodes[c].m * tree_nodes[c].x;
+            y += tree_nodes[c].m * tree_nodes[c].y;
+            z += tree_nodes[c].m * tree_nodes[c].z;
+        }
+    }
+    node->m = m;
+    if (m > 0) {
+        node->x = x / m;
+        node->y = y / m;
+        node->z = z / m;
+    } else {
+        node->x = tree_x[node->begin];
+        node->y = tree_y[node->begin];
+        node->z = tree_z[node->begin];
+    }
+}
+
+static void tree_build(int n) {
+    int k = tree_expand(n);
+    for (int c = 0; c < k; c++)
+        tree_build(tree_nodes[n].child + c);
+    tree_moments(n);
+}
+
+// 粒子 p（排序后的下标）受到的合力与势能 sum_j G*mi*mj/dist
+static void tree_walk(int p, double theta2, double out[4]) {
+    double xi = tree_x[p], yi = tree_y[p], zi = tree_z[p], mi = tree_m[p];
+    double sx = 0.0, sy = 0.0, sz = 0.0, sp = 0.0;
+    int stack[8 * (TREE_BITS + 1)], top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const TreeNode *node = &tree_nodes[stack[--top]];
+        // 包含粒子自身的结点总要展开
+        if (p < node->begin || p >= node->end) {
+            double dx = node->x - xi, dy = node->y - yi, dz = node->z - zi;
+            double d2 = dx * dx + dy * dy + dz * dz;
+            if (node->size * node->size < theta2 * d2) {
+                double dist = sqrt(d2);
+                if (dist > 1e-5) {
+                    double F = G * mi * node->m / (dist * dist);
+                    sx += F * dx / dist;
+                    sy += F * dy / dist;
+                    sz += F * dz / dist;
+                    sp += G * mi * node->m / dist;
+                }
+                continue;
+            }
+        }
+        if (node->nchild > 0) {
+            for (int c = 0; c < node->nchild; c++)
+                stack[top++] = node->child + c;
+            continue;
+        }
+        for (int q = node->begin; q < node->end; q++) {
+            double dx = tree_x[q] - xi;
+            double dy = tree_y[q] - yi;
+            double dz = tree_z[q] - zi;
+            double dist = sqrt(dx * dx + dy * dy + dz * dz);
+            if (dist > 1e-5) {
+                double F = G * mi * tree_m[q] / (dist * dist);
+                sx += F * dx / dist;
+                sy += F * dy / dist;
+                sz += F * dz / dist;
+                sp += G * mi * tree_m[q] / dist;
+            }
+        }
+    }
+    out[0] = sx;
+    out[1] = sy;
+    out[2] = sz;
+    out[3] = sp;
+}
+
+typedef struct {
+    const Particle *particles;
+    double *fx, *fy, *fz;
+    int N, force, energy;
+    int ntop, ntask;
+    atomic_int next_task, next_chunk;
+    double kinetic, potential;
+} TreeSweep;
+
+// 树的顶层由线程 0 按广度优先展开，直到待建的子树足够分给各线程；
+// 队列中 [0, ntop) 是已展开的结点，[ntop, ntop + ntask) 是待建的子树
+static void tree_top_build(TreeSweep *s, int T) {
+    TreeNode *root = &tree_nodes[0];
+    root->begin = 0;
+    root->end = s->N;
+    root->level = 0;
+    atomic_store_explicit(&tree_count, 1, memory_order_relaxed);
+    int head = 0, tail = 0;
+    tree_queue[tail++] = 0;
+    while (head < tail && tail - head < 8 * T) {
+        int n = tree_queue[head++], k = tree_expand(n);
+        for (int c = 0; c < k; c++)
+            tree_queue[tail++] = tree_nodes[n].child + c;
+    }
+    s->ntop = head;
+    s->ntask = tail - head;
+}
+
+// 一次完整的 tree 计算：包围盒、Morton 码、基数排序、建树、遍历，
+// 各阶段之间用屏障分隔
+static void tree_job(int tid, int T, void *ctx) {
+    TreeSweep *s = (TreeSweep *)ctx;
+    const Particle *particles = s->particles;
+    int N = s->N, begin = slice(N, tid, T), end = slice(N, tid + 1, T);
+
+    double *box = tree_bounds + 8 * tid;
+    for (int d = 0; d < 3; d++) {
+        box[d] = INFINITY;
+        box[3 + d] = -INFINITY;
+    }
+    for (int i = begin; i < end; i++) {
+        double r[3] = {particles[i].x, particles[i].y, particles[i].z};
+        for (int d = 0; d < 3; d++) {
+            box[d] = r[d] < box[d] ? r[d] : box[d];
+            box[3 + d] = r[d] > box[3 + d] ? r[d] : box[3 + d];
+        }
+        if (s->energy) {
+            double v2 = particles[i].vx * particles[i].vx + particles[i].vy * particles[i].vy + particles[i].vz * particles[i].vz;
+            reduce_terms[i] = 0.5 * particles[i].mass * v2;
+        }
+    }
+    team_barrier();
+    if (tid == 0) {
+        double lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+        for (int t = 0; t < T; t++) {
+            for (int d = 0; d < 3; d++) {
+                lo[d] = tree_bounds[8 * t + d] < lo[d] ? tree_bounds[8 * t + d] : lo[d];
+                hi[d] = tree_bounds[8 * t + 3 + d] > hi[d] ? tree_bounds[8 * t + 3 + d] : hi[d];
+            }
+        }
+        tree_size = 0.0;
+        for (int d = 0; d < 3; d++) {
+            tree_origin[d] = lo[d];
+            tree_size = hi[d] - lo[d] > tree_size ? hi[d] - lo[d] : tree_size;
+        }
+        if (!(tree_size > 0))
+            tree_size = 1.0;
+    }
+    team_barrier();
+
+    double scale = (1 << TREE_BITS) / tree_size;
+    for (int i = begin; i < end; i++) {
+        tree_key[i] = morton_key(particles[i].x, particles[i].y, particles[i].z, scale);
+        tree_idx[i] = i;
+    }
+
+    // LSD 基数排序：每趟各线程统计自己一段的直方图，线程 0 按
+    // （数位，线程）的顺序求出偏移，再各自稳定地散射
+    uint64_t *key = tree_key, *key_out = tree_key_tmp;
+    int *idx = tree_idx, *idx_out = tree_idx_tmp;
+    for (int shift = 0; shift < 3 * TREE_BITS; shift += TREE_RADIX) {
+        int *hist = tree_hist + (1 << TREE_RADIX) * tid;
+        memset(hist, 0, sizeof(int) << TREE_RADIX);
+        for (int i = begin; i < end; i++)
+            hist[(key[i] >> shift) & ((1 << TREE_RADIX) - 1)]++;
+        team_barrier();
+        if (tid == 0) {
+            int sum = 0;
+            for (int d = 0; d < 1 << TREE_RADIX; d++) {
+                for (int t = 0; t < T; t++) {
+                    int c = tree_hist[(1 << TREE_RADIX) * t + d];
+                    tree_hist[(1 << TREE_RADIX) * t + d] = sum;
+                    sum += c;
+                }
+            }
+        }
+        team_barrier();
+        for (int i = begin; i < end; i++) {
+            int pos = hist[(key[i] >> shift) & ((1 << TREE_RADIX) - 1)]++;
+            key_out[pos] = key[i];
+            idx_out[pos] = idx[i];
+        }
+        team_barrier();
+        uint64_t *kt = key;
+        key = key_out;
+        key_out = kt;
+        int *it = idx;
+        idx = idx_out;
+        idx_out = it;
+    }
+
+    for (int p = begin; p < end; p++) {
+        int i = tree_idx[p];
+        tree_x[p] = particles[i].x;
+        tree_y[p] = particles[i].y;
+        tree_z[p] = particles[i].z;
+        tree_m[p] = particles[i].mass;
+    }
+    team_barrier();
+
+    if (tid == 0)
+        tree_top_build(s, T);
+    team_barrier();
+    int t;
+    while ((t = atomic_fetch_add_explicit(&s->next_task, 1, memory_order_relaxed)) < s->ntask)
+        tree_build(tree_queue[s->ntop + t]);
+    team_barrier();
+    // 顶层结点按展开顺序的逆序求质心，子结点总在父结点之前
+    if (tid == 0)
+        for (int q = s->ntop - 1; q >= 0; q--)
+            tree_moments(tree_queue[q]);
+    team_barrier();
+
+    double theta = tree_theta(), out[4];
+    int c;
+    while ((c = atomic_fetch_add_explicit(&s->next_chunk, 1, memory_order_relaxed)) * TREE_WALK_CHUNK < N) {
+        int p_end = (c + 1) * TREE_WALK_CHUNK < N ? (c + 1) * TREE_WALK_CHUNK : N;
+        for (int p = c * TREE_WALK_CHUNK; p < p_end; p++) {
+            tree_walk(p, theta * theta, out);
+            int i = tree_idx[p];
+            if (s->force) {
+                s->fx[i] = out[0];
+                s->fy[i] = out[1];
+                s->fz[i] = out[2];
+            }
+            // 每对在两个粒子处各算一次，各取一半
+            if (s->energy)
+                row_pot[i] = 0.5 * out[3];
+        }
+    }
+
+    if (s->energy) {
+        team_barrier();
+        reduce_partials(reduce_terms, N, reduce_part, tid, T);
+        reduce_partials(row_pot, N, reduce_part + reduce_chunks(N), tid, T);
+    }
+}
+
+static void tree_run(TreeSweep *s) {
+    int N = s->N;
+    if (N == 0) {
+        s->kinetic = s->potential = 0.0;
+        return;
+    }
+    tree_reserve(N, team_size());
+    if (s->energy) {
+        row_pot_reserve(N);
+        reduce_reserve(N);
+    }
+    atomic_init(&s->next_task, 0);
+    atomic_init(&s->next_chunk, 0);
+    team_run(tree_job, s);
+    if (s->energy) {
+        s->kinetic = reduce_tree(reduce_part, N);
+        s->potential = -reduce_tree(reduce_part + reduce_chunks(N), N);
+    }
+}
+
+// 设置环境变量 NBODY_MIXED_CHECK=1 时，mixed 模式每步再用双精度的 direct 内核
+// 算一遍作用力作为参照，记录每个粒子相对偏差 |F_mixed - F_fp64| / |F_fp64| 的
+// 最大值，程序结束时输出到 stderr。check_mixed.sh 用它检查全部 ref_data 算例
+static double *check_f = NULL;
+static int check_cap = 0, check_steps = 0, check_step_at = 0, check_particle = -1;
+static double check_max = 0.0;
+
+static int mixed_check_enabled(void) {
+    static int on = -1;
+    if (on < 0) {
+        const char *env = getenv("NBODY_MIXED_CHECK");
+        on = env && strcmp(env, "0") != 0;
+    }
+    return on;
+}
+
+static void mixed_check_report(void) {
+    fprintf(stderr, "mixed check: %d steps, max relative force deviation %.3e (step %d, particle %d)\n",
+            check_steps, check_max, check_step_at, check_particle);
+}
+
+static void mixed_check(const Particle particles[], const double fx[], const double fy[], const double fz[], int N) {
+    if (N > check_cap) {
+        free(check_f);
+        check_f = (double *)malloc(sizeof(double) * 3 * (size_t)N);
+        check_cap = N;
+    }
+    if (check_steps == 0)
+        atexit(mixed_check_report);
+    double *rx = check_f, *ry = rx + N, *rz = ry + N;
+    Sweep ref = {particles, rx, ry, rz, N, 1, FORCE_DIRECT, 0, 0};
+    sweep_run(&ref);
+    for (int i = 0; i < N; i++) {
+        double norm = sqrt(rx[i] * rx[i] + ry[i] * ry[i] + rz[i] * rz[i]);
+        double dx = fx[i] - rx[i], dy = fy[i] - ry[i], dz = fz[i] - rz[i];
+        double dev = sqrt(dx * dx + dy * dy + dz * dz) / norm;
+        if (norm > 0 && dev > check_max) {
+            check_max = dev;
+            check_step_at = check_steps;
+            check_particle = i;
+        }
+    }
+    check_steps++;
+}
+
+// 计算粒子之间的引力
+void compute_forces(Particle particles[], double fx[], double fy[], double fz[], int N) {
+    if (force_mode() == FORCE_TREE) {
+        TreeSweep t = {particles, fx, fy, fz, N, 1, energy_mode() == ENERGY_FUSED};
+        tree_run(&t);
+        if (t.energy) {
+            fused_kinetic = t.kinetic;
+            fused_potential = t.potential;
+            fused_particles = particles;
+            fused_n = N;
+            fused_gen = state_gen;
+        }
+        return;
+    }
+    Sweep s = {particles, fx, fy, fz, N, 1, force_mode(), force_mode() == FORCE_SYMMETRIC,
+               energy_mode() == ENERGY_FUSED};
+    sweep_run(&s);
+    if (force_mode() == FORCE_MIXED && mixed_check_enabled())
+        mixed_check(particles, fx, fy, fz, N);
+    if (s.energy) {
+        // 此时速度尚未更新，正是上一步结束时的动能
+        fused_kinetic = s.kinetic;
+        fused_potential = s.potential;
+        fused_particles = particles;
+        fused_n = N;
+        fused_gen = state_gen;
+    }
+}
+
+typedef struct {
+    Particle *particles;
+    const double *fx, *fy, *fz;
+    int N, update;
+} Advance;
+
+// 按 REDUCE_CHUNK 个粒子一块处理本线程的一段：update 为 1 时先更新这一块的
+// 速度与位置（每个粒子的运算与串行版本相同），接着趁数据还在缓存中求出
+// 这一块的动量块和，动量归约因此与位置更新重叠在同一遍里
+static void advance_job(int tid, int T, void *ctx) {
+    Advance *a = (Advance *)ctx;
+    Particle *particles = a->particles;
+    int N = a->N, chunks = reduce_chunks(N);
+    double *tx = reduce_terms, *ty = tx + N, *tz = ty + N;
+    double *part = reduce_part + 2 * chunks;
+    for (int c = slice(chunks, tid, T); c < slice(chunks, tid + 1, T); c++) {
+        int end = (c + 1) * REDUCE_CHUNK < N ? (c + 1) * REDUCE_CHUNK : N;
+        for (int i = c * REDUCE_CHUNK; i < end; i++) {
+            if (a->update) {
+                particles[i].vx += a->fx[i] / particles[i].mass * DT;
+                particles[i].vy += a->fy[i] / particles[i].mass * DT;
+                particles[i].vz += a->fz[i] / particles[i].mass * DT;
+                particles[i].x += particles[i].vx * DT;
+                particles[i].y += particles[i].vy * DT;
+                particles[i].z += particles[i].vz * DT;
+            }
+            tx[i] = particles[i].mass * particles[i].vx;
+            ty[i] = particles[i].mass * particles[i].vy;
+            tz[i] = particles[i].mass * particles[i].vz;
+        }
+        part[c] = chunk_sum(tx, N, c);
+        part[chunks + c] = chunk_sum(ty, N, c);
+        part[2 * chunks + c] = chunk_sum(tz, N, c);
+    }
+}
+
+// 更新粒子的位置和速度
+void update_particles(Particle particles[], double fx[], double fy[], double fz[], int N) {
+    Advance a = {particles, fx, fy, fz, N, 1};
+    reduce_reserve(N);
+    team_run(advance_job, &a);
+    momentum_ready = 1;
+    momentum_n = N;
+    state_gen++;
+}
+
+// 计算体系总动量的三个分量（可复现的并行归约）。紧跟在 update_particles
+// 之后调用时块和已经算好，只剩下块和的二叉树
+void compute_total_momentum(Particle particles[], double *px, double *py, double *pz, int N) {
+    if (!momentum_ready || momentum_n != N) {
+        Advance a = {particles, NULL, NULL, NULL, N, 0};
+        reduce_reserve(N);
+        team_run(advance_job, &a);
+    }
+    momentum_ready = 0;
+    int chunks = reduce_chunks(N);
+    double *part = reduce_part + 2 * chunks;
+    *px = reduce_tree(part, N);
+    *py = reduce_tree(part + chunks, N);
+    *pz = reduce_tree(part + 2 * chunks, N);
+}
+
+// 计算系统的总能量（动能和势能）。势能按行并行（三角形，由分块调度均衡），
+// 每行按 j 递增求和，各行之和再做可复现归约，结果与线程数无关。
+// tree 模式下势能也由树近似，与力的精度一致，也不再是 O(N²)
+static double total_energy_exact(Particle particles[], int N) {
+    if (force_mode() == FORCE_TREE) {
+        TreeSweep t = {particles, NULL, NULL, NULL, N, 0, 1};
+        tree_run(&t);
+        return t.kinetic + t.potential;
+    }
+    Sweep s = {particles, NULL, NULL, NULL, N, 0, FORCE_DIRECT, 0, 1};
+    sweep_run(&s);
+    return s.kinetic + s.potential;
+}
+
+// fused 模式下，若 compute_forces 记录的能量属于当前这组粒子的当前状态，
+// 或者之后只经过一次 update_particles（即上一步结束时的能量，晚一步），
+// 就直接返回它；其余情况（没有记录、换了粒子、落后不止一代）做完整计算
+double compute_total_energy(Particle particles[], int N) {
+    if (energy_mode() == ENERGY_FUSED && fused_particles == particles && fused_n == N &&
+        state_gen - fused_gen <= 1)
+        return fused_kinetic + fused_potential;
+    return total_energy_exact(particles, N);
 }
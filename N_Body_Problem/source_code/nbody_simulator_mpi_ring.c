@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <stddef.h>
+
+#define G 6.67430e-11 // 引力常数
+#define DT 1       // 时间步长
+#define STEPS 1002    // 时间步数
+#define RAND_NUM ((double)rand() / RAND_MAX)
+#define ERR 5e-7
+
+typedef struct {
+    double x, y, z;
+    double vx, vy, vz;
+    double mass;
+} Particle;
+void read_ref(double* array, int N);
+
+// 环形（systolic）版本的 MPI 程序，与 nbody_simulator_mpi.c 使用相同的初值与校验。
+// 每个进程只保存自己负责的 local_n 个粒子，不再复制全部 N 个：计算力时，
+// 各进程的粒子块（位置与质量）沿进程环传递，每一轮先用 MPI_Irecv/MPI_Isend
+// 把手中的块交给右邻并接收左邻的块，再计算本地粒子与手中这块的相互作用，
+// 通信被计算掩盖。P 轮之后每个本地粒子都与全部 N 个粒子相互作用过。
+// 每个进程的粒子内存为 O(N/P)，每步发送与接收的数据量也都是 O(N)，与进程数无关。
+//
+// 通信只传计算力所需的字段：质量在开始时交换一次（每个进程保存全部 N 个质量），
+// 之后每步只传位置 x, y, z，每个粒子 24 字节，而不是整个 56 字节的 Particle。
+// 也可以选择 allgather 方式：与框架程序一样每个进程保存全部粒子、每步做一次
+// MPI_Allgatherv，但用只含 x, y, z 三个字段的派生数据类型直接在 Particle 数组之间收发。
+//
+// 用法：mpirun -n P ./nbody_simulator_mpi_ring [N] [ring|allgather]
+//       N 默认 4096，N 不必被 P 整除；交换方式默认为 ring。
+
+// 第 r 个进程负责的粒子为 [block_first(r), block_first(r+1))
+static int block_first(int N, int size, int r) {
+    return (int)((long long)N * r / size);
+}
+
+static int block_count(int N, int size, int r) {
+    return block_first(N, size, r + 1) - block_first(N, size, r);
+}
+
+// 与 Particle 数组中每个元素的 x, y, z（或 mass）对应的派生数据类型，
+// extent 为 sizeof(Particle)，count 个元素就是 count 个粒子的这几个字段
+static MPI_Datatype particle_fields(int count, const int *offsets) {
+    MPI_Datatype fields, resized;
+    int lengths[3] = {1, 1, 1};
+    MPI_Aint displs[3];
+    MPI_Datatype types[3] = {MPI_DOUBLE, MPI_DOUBLE, MPI_DOUBLE};
+    for (int k = 0; k < count; k++)
+        displs[k] = offsets[k];
+    MPI_Type_create_struct(count, lengths, displs, types, &fields);
+    MPI_Type_create_resized(fields, 0, sizeof(Particle), &resized);
+    MPI_Type_commit(&resized);
+    MPI_Type_free(&fields);
+    return resized;
+}
+
+// 参与计算的一组粒子：第 j 个粒子的位置为 x[j * stride] 等，质量为 m[j * stride]。
+// 环上传递的块 stride 为 1，直接使用 Particle 数组时 stride 为 7
+typedef struct {
+    const double *x, *y, *z, *m;
+    int stride, n;
+} Source;
+
+// 环上传递的块：n 个粒子按 x[n], y[n], z[n] 的顺序连续存放
+static void pack_positions(const Particle particles[], int n, double *blk) {
+    for (int i = 0; i < n; i++) {
+        blk[i] = particles[i].x;
+        blk[n + i] = particles[i].y;
+        blk[2 * n + i] = particles[i].z;
+    }
+}
+
+// 本地粒子与一组粒子的相互作用，acc 为累加目标
+typedef void (*BlockKernel)(const Particle local[], int local_n, const Source *src, double *acc);
+
+// acc 为 fx[local_n], fy[local_n], fz[local_n]
+static void block_forces(const Particle local[], int local_n, const Source *src, double *acc) {
+    const double *bx = src->x, *by = src->y, *bz = src->z, *bm = src->m;
+    int s = src->stride, n = src->n;
+    double *fx = acc, *fy = acc + local_n, *fz = acc + 2 * local_n;
+    for (int i = 0; i < local_n; i++) {
+        double sx = fx[i], sy = fy[i], sz = fz[i];
+        for (int j = 0; j < n; j++) {
+            double dx = bx[j * s] - local[i].x;
+            double dy = by[j * s] - local[i].y;
+            double dz = bz[j * s] - local[i].z;
+            double dist = sqrt(dx * dx + dy * dy + dz * dz);
+            if (dist > 1e-5) {
+                double F = G * local[i].mass * bm[j * s] / (dist * dist);
+                sx += F * dx / dist;
+                sy += F * dy / dist;
+                sz += F * dz / dist;
+            }
+        }
+        fx[i] = sx;
+        fy[i] = sy;
+        fz[i] = sz;
+    }
+}
+
+// acc 为一个势能累加值；每对在两个粒子处各算一次，各取一半
+static void block_potential(const Particle local[], int local_n, const Source *src, double *acc) {
+    const double *bx = src->x, *by = src->y, *bz = src->z, *bm = src->m;
+    int s = src->stride, n = src->n;
+    double sum = 0.0;
+    for (int i = 0; i < local_n; i++) {
+        for (int j = 0; j < n; j++) {
+            double dx = bx[j * s] - local[i].x;
+            double dy = by[j * s] - local[i].y;
+            double dz = bz[j * s] - local[i].z;
+            double dist = sqrt(dx * dx + dy * dy + dz * dz);
+            if (dist > 1e-5) { // 避免除零错误
+                sum -= 0.5 * G * local[i].mass * bm[j * s] / dist;
+            }
+        }
+    }
+    *acc += sum;
+}
+
+// 粒子数据的交换方式
+enum { EXCHANGE_RING, EXCHANGE_ALLGATHER };
+
+// 进程间共享的通信状态
+typedef struct {
+    int mode, N, rank, size;
+    const double *mass;       // ring：全部 N 个粒子的质量，开始时交换一次
+    double *buf;              // ring：两块位置缓冲区，一块正在计算，另一块正在接收
+    Particle *all;            // allgather：全部 N 个粒子，只有位置每步更新
+    int *counts, *displs;     // 各进程的粒子数与起始下标
+    MPI_Datatype position;    // Particle 中的 x, y, z
+} Exchange;
+
+// ring：让每个进程的位置块沿环走一圈，每到一个进程就对它调用一次 kernel。
+// allgather：先同步全部粒子的位置，再对整个数组调用一次 kernel。
+static void exchange_pass(const Particle local[], int local_n, Exchange *ex, BlockKernel kernel, double *acc) {
+    int N = ex->N, rank = ex->rank, size = ex->size;
+    if (ex->mode == EXCHANGE_ALLGATHER) {
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, ex->all, ex->counts, ex->displs, ex->position, MPI_COMM_WORLD);
+        Source src = {&ex->all[0].x, &ex->all[0].y, &ex->all[0].z, &ex->all[0].mass, sizeof(Particle) / sizeof(double), N};
+        kernel(local, local_n, &src, acc);
+        return;
+    }
+
+    int cap = 3 * block_count(N, size, size - 1);
+    int left = (rank + size - 1) % size, right = (rank + 1) % size;
+    double *cur = ex->buf, *next = ex->buf + cap;
+    int owner = rank;   // 手中这块原本属于哪个进程
+    pack_positions(local, local_n, cur);
+    for (int k = 0; k < size; k++) {
+        MPI_Request req[2];
+        int cnt = block_count(N, size, owner);
+        int next_owner = (owner + size - 1) % size;
+        int more = k + 1 < size;
+        if (more) {
+            MPI_Irecv(next, 3 * block_count(N, size, next_owner), MPI_DOUBLE, left, 0, MPI_COMM_WORLD, &req[0]);
+            MPI_Isend(cur, 3 * cnt, MPI_DOUBLE, right, 0, MPI_COMM_WORLD, &req[1]);
+        }
+        Source src = {cur, cur + cnt, cur + 2 * cnt, ex->mass + block_first(N, size, owner), 1, cnt};
+        kernel(local, local_n, &src, acc);
+        if (more)
+            MPI_Waitall(2, req, MPI_STATUSES_IGNORE);
+        double *t = cur;
+        cur = next;
+        next = t;
+        owner = next_owner;
+    }
+}
+
+void compute_forces(const Particle local[], int local_n, Exchange *ex, double f[]) {
+    memset(f, 0, sizeof(double) * 3 * local_n);
+    exchange_pass(local, local_n, ex, block_forces, f);
+}
+
+void update_particles(Particle particles[], double fx[], double fy[], double fz[], int n_particles) {
+    for (int i = 0; i < n_particles; i++) {
+        particles[i].vx += fx[i] / particles[i].mass * DT;
+        particles[i].vy += fy[i] / particles[i].mass * DT;
+        particles[i].vz += fz[i] / particles[i].mass * DT;
+        particles[i].x += particles[i].vx * DT;
+        particles[i].y += particles[i].vy * DT;
+        particles[i].z += particles[i].vz * DT;
+    }
+}
+
+void compute_total_momentum(Particle particles[], double *px, double *py, double *pz, int n_particles) {
+    *px = *py = *pz = 0.0;
+    for (int i = 0; i < n_particles; i++) {
+        *px += particles[i].mass * particles[i].vx;
+        *py += particles[i].mass * particles[i].vy;
+        *pz += particles[i].mass * particles[i].vz;
+    }
+}
+
+// 本进程粒子的动能与它们的势能份额，各进程之和为体系总能量
+double compute_total_energy(const Particle local[], int local_n, Exchange *ex) {
+    double total_kinetic = 0.0;
+    double total_potential = 0.0;
+
+    // 计算动能
+    for (int i = 0; i < local_n; i++) {
+        double v2 = local[i].vx * local[i].vx + local[i].vy * local[i].vy + local[i].vz * local[i].vz;
+        total_kinetic += 0.5 * local[i].mass * v2;
+    }
+
+    // 计算势能
+    exchange_pass(local, local_n, ex, block_potential, &total_potential);
+
+    return total_kinetic + total_potential;
+}
+
+void read_ref(double* array, int N){
+    FILE *fp;
+    int i;
+    // 打开文件
+    char filename[128];
+    sprintf(filename, "ref_data/%d_1.ref", N);
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        printf("无法打开文件！\n");
+        return;
+    }
+
+    for (i = 0; i < 33; i++) {
+        if (fscanf(fp, "%lf", &array[i]) != 1) {
+            printf("读取数据时出错，位置：%d\n", i);
+            fclose(fp);
+            return;
+        }
+    }
+
+    // 关闭文件
+    fclose(fp);
+}
+
+// 第 idx 个粒子的位置送到 0 号进程
+static void fetch_position(const Particle local[], int N, int rank, int size, int idx, double pos[3]) {
+    int owner = 0;
+    while (block_first(N, size, owner + 1) <= idx)
+        owner++;
+    if (rank == owner) {
+        const Particle *p = &local[idx - block_first(N, size, rank)];
+        pos[0] = p->x;
+        pos[1] = p->y;
+        pos[2] = p->z;
+        if (owner != 0)
+            MPI_Send(pos, 3, MPI_DOUBLE, 0, 1, MPI_COMM_WORLD);
+    } else if (rank == 0) {
+        MPI_Recv(pos, 3, MPI_DOUBLE, owner, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+int main(int argc, char **argv) {
+    int rank, size;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    const int N = argc > 1 ? atoi(argv[1]) : 4096;
+    const char *mode = argc > 2 ? argv[2] : "ring";
+    if (N < size || (strcmp(mode, "ring") != 0 && strcmp(mode, "allgather") != 0)) {
+        if (rank == 0)
+            printf("Usage: %s [N >= %d] [ring|allgather]\n", argv[0], size);
+        MPI_Finalize();
+        return 1;
+    }
+    double ref[33];
+    if(rank == 0)
+        read_ref(ref, N);
+    int pass=0;
+    int step = 0;
+    const int local_n = block_count(N, size, rank);
+    const int max_n = block_count(N, size, size - 1);
+    const int position_offsets[3] = {offsetof(Particle, x), offsetof(Particle, y), offsetof(Particle, z)};
+    const int mass_offset[1] = {offsetof(Particle, mass)};
+    MPI_Datatype mass_type = particle_fields(1, mass_offset);
+    Exchange ex = {strcmp(mode, "allgather") == 0 ? EXCHANGE_ALLGATHER : EXCHANGE_RING, N, rank, size};
+    ex.position = particle_fields(3, position_offsets);
+    ex.counts = malloc(sizeof(int) * size);
+    ex.displs = malloc(sizeof(int) * size);
+    for (int r = 0; r < size; r++) {
+        ex.counts[r] = block_count(N, size, r);
+        ex.displs[r] = block_first(N, size, r);
+    }
+    // allgather 方式下本地粒子就是全体粒子数组中属于本进程的一段
+    Particle *local_particles;
+    double *mass = NULL;
+    if (ex.mode == EXCHANGE_ALLGATHER) {
+        ex.all = malloc(sizeof(Particle) * N);
+        local_particles = ex.all + block_first(N, size, rank);
+    } else {
+        local_particles = malloc(sizeof(Particle) * max_n);
+        ex.buf = malloc(sizeof(double) * 6 * max_n);
+        ex.mass = mass = malloc(sizeof(double) * N);
+    }
+    double *f = malloc(sizeof(double) * 3 * max_n);
+    double *fx = f, *fy = f + local_n, *fz = f + 2 * local_n;
+    double local[4], global[4];
+    double initial_momentum_x=0, initial_momentum_y=0, initial_momentum_z=0, initial_energy=0.0;
+    double start_time, total_time;
+
+    // 初始化粒子数据：0 号进程按与串行版本相同的随机数顺序逐块生成，
+    // 每生成一块就发给它的进程，任何进程都不需要保存全部 N 个粒子
+    if (rank == 0) {
+        Particle *block = malloc(sizeof(Particle) * max_n);
+		srand(1);
+        for (int r = 0; r < size; r++) {
+            int n = block_count(N, size, r);
+            Particle *particles = r == 0 ? local_particles : block;
+            for (int i = 0; i < n; i++) {
+                particles[i].x = RAND_NUM * 10000;
+                particles[i].y = RAND_NUM * 10000;
+                particles[i].z = RAND_NUM *  10000;
+                particles[i].vx = RAND_NUM * 1000;
+                particles[i].vy = RAND_NUM * 1000;
+                particles[i].vz = RAND_NUM * 1000;
+
+                particles[i].mass = RAND_NUM * 10000;
+
+                initial_momentum_x += particles[i].mass * particles[i].vx;
+                initial_momentum_y += particles[i].mass * particles[i].vy;
+                initial_momentum_z += particles[i].mass * particles[i].vz;
+            }
+            if (r != 0)
+                MPI_Send(block, n * sizeof(Particle), MPI_BYTE, r, 0, MPI_COMM_WORLD);
+        }
+        free(block);
+    } else {
+        MPI_Recv(local_particles, local_n * sizeof(Particle), MPI_BYTE, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+
+    // 质量在整个模拟中不变，只在开始时交换一次
+    if (ex.mode == EXCHANGE_ALLGATHER)
+        MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, ex.all, ex.counts, ex.displs, mass_type, MPI_COMM_WORLD);
+    else
+        MPI_Allgatherv(local_particles, local_n, mass_type, mass, ex.counts, ex.displs, MPI_DOUBLE, MPI_COMM_WORLD);
+
+    // 初始总能量同样分布式计算
+    local[0] = compute_total_energy(local_particles, local_n, &ex);
+    MPI_Reduce(local, &initial_energy, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    start_time = MPI_Wtime();
+    // 模拟
+    for (step = 0; step < STEPS; step++) {
+        compute_forces(local_particles, local_n, &ex, f);
+        update_particles(local_particles, fx, fy, fz, local_n);
+
+        // 动量与能量只在校验时需要，只在这些步计算，四个分量一次归约到 0 号进程
+	   	if(step % 100 == 1){
+            int i = step / 100;
+            double pos[3];
+            compute_total_momentum(local_particles, &local[0], &local[1], &local[2], local_n);
+            local[3] = compute_total_energy(local_particles, local_n, &ex);
+            MPI_Reduce(local, global, 4, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+            fetch_position(local_particles, N, rank, size, N / 2 + i, pos);
+
+        	if (rank == 0) {
+                printf("Initial Momentum: (%f, %f, %f)\n", initial_momentum_x, initial_momentum_y, initial_momentum_z);
+                printf("Current Momentum: (%f, %f, %f)\n", global[0], global[1], global[2]);
+                printf("Initial Energy: %f\n", initial_energy);
+                printf("Current Energy: %f\n", global[3]);
+                if(fabs(initial_momentum_x - global[0]) > ERR *3e7
+                        || fabs(initial_momentum_y - global[1]) > ERR *3e7
+                        || fabs(initial_momentum_z - global[2]) > ERR *3e7
+                        || fabs(initial_energy - global[3]) > ERR*3e8
+                        || fabs(pos[0] - ref[i * 3]) > ERR
+                        || fabs(pos[1] - ref[i * 3 + 1]) > ERR
+                        || fabs(pos[2] - ref[i * 3 + 2]) > ERR){
+                    printf("Validation Fail, Check your Optimization!\n");
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                else
+                    printf("Validation Passed\n");
+                printf("\n");
+            }
+        }
+
+    }
+    total_time = MPI_Wtime() - start_time;
+    if(step == STEPS) pass=1;
+    if(rank == 0) {
+        printf("total simulation ends in %f sec\n", total_time);
+        if(pass)
+        printf("CONGRATULATIONS, YOU DID IT!\n");
+    }
+    if (ex.mode == EXCHANGE_ALLGATHER) {
+        free(ex.all);
+    } else {
+        free(local_particles);
+        free(ex.buf);
+        free(mass);
+    }
+    free(f);
+    free(ex.counts);
+    free(ex.displs);
+    MPI_Type_free(&ex.position);
+    MPI_Type_free(&mass_type);
+    MPI_Finalize();
+    return 0;
+}